@@ -0,0 +1,52 @@
+#ifndef LEVEL_PACK_H
+#define LEVEL_PACK_H
+
+#include <stdint.h>
+
+// Level pack file, shared by the game and the levelc compiler. The game maps
+// it read-only and uses the brick arrays in place, so the layout is exactly
+// what's in memory: little-endian, with every array starting on a
+// LEVEL_PACK_ALIGNMENT boundary.
+//
+//   level_pack_header_t
+//   level_pack_stage_t stages[num_stages]
+//   float brick_x[num_bricks]      pixels
+//   float brick_y[num_bricks]      pixels
+//   uint8_t brick_type[num_bricks] brick_type_t
+//
+// Offsets are from the start of the file. Each stage is a contiguous run of
+// the brick arrays, sorted by y.
+
+#define LEVEL_PACK_MAGIC "UBLP"
+#define LEVEL_PACK_VERSION 1
+#define LEVEL_PACK_ALIGNMENT 16
+#define LEVEL_PACK_MAX_STAGE_BRICKS (1 << 16)
+#define LEVEL_PACK_STAGE_NAME_SIZE 24
+
+typedef enum {
+    BRICK_NORMAL, // breaks when a ball bounces off it
+    BRICK_SOLID,  // never breaks
+    NUM_BRICK_TYPES,
+} brick_type_t;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t scale; // screen pixels per logical pixel the coordinates are in
+    uint32_t num_stages;
+    uint32_t num_bricks;
+    uint32_t stages_offset;
+    uint32_t brick_x_offset;
+    uint32_t brick_y_offset;
+    uint32_t brick_type_offset;
+    uint32_t file_size;
+} level_pack_header_t;
+
+typedef struct {
+    char name[LEVEL_PACK_STAGE_NAME_SIZE]; // zero padded
+    uint32_t first_brick;
+    uint32_t num_bricks;
+    float start_x, start_y; // pixels, where the player starts standing
+} level_pack_stage_t;
+
+#endif
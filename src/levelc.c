@@ -0,0 +1,247 @@
+// Level pack compiler. Builds a pack (see level_pack.h) from a text
+// description with one command per line, in logical pixels with y going up:
+//
+//   # comment
+//   stage NAME          starts a new stage
+//   start X Y           where the player starts, standing centered on X
+//   brick X Y [TYPE]    a brick with its bottom left corner at X, Y
+//   row X Y N [TYPE]    N bricks side by side from X, Y
+//
+// TYPE is normal (the default) or solid.
+//
+// usage: levelc INPUT OUTPUT
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "level_pack.h"
+
+const uint32_t scale = 10;      // screen pixels per logical pixel, as in main.c
+const float brick_width = 6.0f; // logical pixels
+
+typedef struct {
+    float x, y;
+    uint8_t type;
+    int order; // keeps bricks at the same height in the order they were written
+} brick_t;
+
+const char *input_path;
+int line_number;
+
+level_pack_stage_t *stages;
+int num_stages, stages_capacity;
+bool stage_has_start;
+
+brick_t *bricks;
+int num_bricks, bricks_capacity;
+
+void fail(const char *message) {
+    if (line_number > 0) {
+        fprintf(stderr, "%s:%d: %s\n", input_path, line_number, message);
+    } else {
+        fprintf(stderr, "%s: %s\n", input_path, message);
+    }
+    exit(EXIT_FAILURE);
+}
+
+void *grow(void *array, int *capacity, int count, size_t size) {
+    if (count < *capacity) {
+        return array;
+    }
+    *capacity = *capacity > 0 ? *capacity * 2 : 64;
+    array = realloc(array, *capacity * size);
+    if (array == NULL) {
+        fail("out of memory");
+    }
+    return array;
+}
+
+int compare_bricks(const void *a, const void *b) {
+    const brick_t *x = a;
+    const brick_t *y = b;
+    if (x->y != y->y) {
+        return x->y < y->y ? -1 : 1;
+    }
+    return x->order - y->order;
+}
+
+// The game finds bricks by binary search on y, so each stage is sorted.
+void finish_stage() {
+    if (num_stages == 0) {
+        return;
+    }
+    level_pack_stage_t *stage = &stages[num_stages - 1];
+    if (!stage_has_start) {
+        fail("stage has no start");
+    }
+    stage->num_bricks = num_bricks - stage->first_brick;
+    if (stage->num_bricks > LEVEL_PACK_MAX_STAGE_BRICKS) {
+        fail("stage has too many bricks");
+    }
+    qsort(&bricks[stage->first_brick], stage->num_bricks, sizeof(brick_t), compare_bricks);
+}
+
+uint8_t parse_type(const char *name) {
+    if (name[0] == '\0' || strcmp(name, "normal") == 0) {
+        return BRICK_NORMAL;
+    }
+    if (strcmp(name, "solid") == 0) {
+        return BRICK_SOLID;
+    }
+    fail("unknown brick type");
+    return BRICK_NORMAL;
+}
+
+void add_brick(float x, float y, uint8_t type) {
+    bricks = grow(bricks, &bricks_capacity, num_bricks, sizeof(brick_t));
+    bricks[num_bricks] = (brick_t){.x = x * scale, .y = y * scale, .type = type, .order = num_bricks};
+    num_bricks++;
+}
+
+void parse_line(char *line) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+    char command[16];
+    int n;
+    if (sscanf(line, "%15s%n", command, &n) != 1) {
+        return;
+    }
+    char *args = line + n;
+
+    if (strcmp(command, "stage") == 0) {
+        finish_stage();
+        stages = grow(stages, &stages_capacity, num_stages, sizeof(level_pack_stage_t));
+        level_pack_stage_t *stage = &stages[num_stages++];
+        memset(stage, 0, sizeof(*stage));
+        stage->first_brick = num_bricks;
+        stage_has_start = false;
+
+        while (*args == ' ' || *args == '\t') {
+            args++;
+        }
+        size_t length = strcspn(args, "\r\n");
+        if (length == 0) {
+            fail("stage needs a name");
+        }
+        if (length >= LEVEL_PACK_STAGE_NAME_SIZE) {
+            fail("stage name is too long");
+        }
+        memcpy(stage->name, args, length);
+        return;
+    }
+
+    if (num_stages == 0) {
+        fail("expected a stage first");
+    }
+
+    float x, y;
+    char type_name[16] = "";
+    if (strcmp(command, "start") == 0) {
+        if (sscanf(args, "%f %f", &x, &y) != 2) {
+            fail("expected start X Y");
+        }
+        stages[num_stages - 1].start_x = x * scale;
+        stages[num_stages - 1].start_y = y * scale;
+        stage_has_start = true;
+    } else if (strcmp(command, "brick") == 0) {
+        if (sscanf(args, "%f %f %15s", &x, &y, type_name) < 2) {
+            fail("expected brick X Y [TYPE]");
+        }
+        add_brick(x, y, parse_type(type_name));
+    } else if (strcmp(command, "row") == 0) {
+        int count;
+        if (sscanf(args, "%f %f %d %15s", &x, &y, &count, type_name) < 3 || count < 1) {
+            fail("expected row X Y N [TYPE]");
+        }
+        uint8_t type = parse_type(type_name);
+        for (int i = 0; i < count; i++) {
+            add_brick(x + i * brick_width, y, type);
+        }
+    } else {
+        fail("unknown command");
+    }
+}
+
+size_t align(size_t offset) {
+    return (offset + LEVEL_PACK_ALIGNMENT - 1) / LEVEL_PACK_ALIGNMENT * LEVEL_PACK_ALIGNMENT;
+}
+
+// Lay the pack out exactly as the game maps it. Like the game, this assumes
+// a little-endian machine.
+void write_pack(const char *path) {
+    level_pack_header_t header = {
+        .magic = LEVEL_PACK_MAGIC,
+        .version = LEVEL_PACK_VERSION,
+        .scale = scale,
+        .num_stages = num_stages,
+        .num_bricks = num_bricks,
+    };
+    header.stages_offset = align(sizeof(header));
+    header.brick_x_offset = align(header.stages_offset + num_stages * sizeof(level_pack_stage_t));
+    header.brick_y_offset = align(header.brick_x_offset + num_bricks * sizeof(float));
+    header.brick_type_offset = align(header.brick_y_offset + num_bricks * sizeof(float));
+    header.file_size = header.brick_type_offset + num_bricks;
+
+    uint8_t *data = calloc(header.file_size, 1);
+    if (data == NULL) {
+        fail("out of memory");
+    }
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + header.stages_offset, stages, num_stages * sizeof(level_pack_stage_t));
+    float *brick_x = (float *)(data + header.brick_x_offset);
+    float *brick_y = (float *)(data + header.brick_y_offset);
+    uint8_t *brick_type = data + header.brick_type_offset;
+    for (int i = 0; i < num_bricks; i++) {
+        brick_x[i] = bricks[i].x;
+        brick_y[i] = bricks[i].y;
+        brick_type[i] = bricks[i].type;
+    }
+
+    line_number = 0;
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fail("can't open output");
+    }
+    bool written = fwrite(data, 1, header.file_size, file) == header.file_size;
+    if (fclose(file) != 0 || !written) {
+        remove(path);
+        fail("can't write output");
+    }
+    free(data);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s INPUT OUTPUT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    input_path = argv[1];
+
+    FILE *file = fopen(input_path, "r");
+    if (file == NULL) {
+        fail("can't open");
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        parse_line(line);
+    }
+    fclose(file);
+    finish_stage();
+    line_number = 0;
+    if (num_stages == 0) {
+        fail("no stages");
+    }
+
+    write_pack(argv[2]);
+    printf("%s: %d stages, %d bricks\n", argv[2], num_stages, num_bricks);
+
+    free(stages);
+    free(bricks);
+    return EXIT_SUCCESS;
+}
@@ -4,19 +4,21 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
-#include <SDL2/SDL_mixer.h>
 #endif
 
 #ifdef __linux__
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
-#include <SDL2/SDL_mixer.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #elif _WIN32
 #include <SDL.h>
 #include <SDL_image.h>
 #include <SDL_ttf.h>
-#include <SDL_mixer.h>
 #endif
 
 #include <assert.h>
@@ -25,14 +27,18 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 
+#include "level_pack.h"
+
 const char *window_title = "Uphill Break";
 const uint32_t scale = 10;
 const uint32_t screen_width = 84 * scale;
 const uint32_t screen_height = 48 * scale;
 const float seconds_per_frame = 1.0f / 60.0f;
 const SDL_Color bg_color = { 0xC7, 0xF0, 0xD8, 0xFF };
+const SDL_Color sprite_color = { 0x43, 0x52, 0x3D, 0xFF };
 
 const float ball_radius = 2.5f * scale;   // pixels
 const float player_width = 7.0f * scale;  // pixels
@@ -69,7 +75,61 @@ const float time_to_max_jump = 3.2f * scale;           // steps
 const float camera_focus_bottom_margin = 12.8f * scale;
 const float camera_move_factor = 0.04f;
 
-#define MAX_NUM_BRICKS 256
+const uint32_t max_catch_up_steps = 8;
+const uint32_t idle_wait_timeout = 500;   // ms
+const uint32_t idle_audio_poll_time = 20; // ms
+
+const float particle_size = 1.0f * scale;                  // pixels
+const float particle_debris_speed = 24.0f * scale;         // pixels/s
+const float particle_dust_speed = 10.0f * scale;           // pixels/s
+const float particle_dust_drag = 6.0f;                     // 1/s
+const float max_particle_step = 0.1f;                      // s
+
+const uint32_t multi_ball_start_count = 16;
+const uint32_t multi_ball_split_count = 2;
+
+const float grid_cell_height = 6.0f * scale; // pixels
+
+const uint8_t ghost_alpha = 0x50;
+
+const float synth_attack_time = 0.002f; // s
+const int audio_frequency = 44100;      // Hz
+const int audio_volume = 64;            // out of 256
+
+#define MAX_NUM_BRICKS LEVEL_PACK_MAX_STAGE_BRICKS
+#define NUM_RANDOM_BRICKS 255
+#define MAX_VISIBLE_BRICKS 1024
+#define MAX_NUM_BALLS 4096
+#define GRID_COLUMNS 12
+#define GRID_ROWS 64
+#define NUM_GRID_CELLS (GRID_COLUMNS * GRID_ROWS)
+#define MAX_NUM_PARTICLES (1 << 17)
+#define EFFECT_QUEUE_SIZE 256
+#define NUM_BRICK_BREAK_PITCHES 8
+#define MAX_NUM_VOICES 16
+#define MIN_AUDIO_FRAMES 64
+#define MAX_AUDIO_FRAMES 4096
+#define AUDIO_QUEUE_SIZE 64
+#define GHOST_VERSION 1
+#define GHOST_HEADER_SIZE 12
+#define GHOST_BUFFER_SIZE 4096
+#define GHOST_MAX_STEP_SIZE 21 // flags and four varints
+#define GHOST_QUEUE_SIZE 1024
+#define GHOST_STEP_QUEUE_SIZE 256
+#define SESSION_VERSION 2
+#define SESSION_HEADER_SIZE 8
+#define SESSION_SEED 0x80
+#define REPLAY_QUEUE_SIZE 1024
+#define SESSION_BYTE_QUEUE_SIZE 4096
+#define MAX_NUM_REPLAYS 64
+#define MAX_PERF_FRAMES (1 << 20)
+#define MAX_PERF_PASSES 31
+#define MAX_NUM_GAMES 16
+#define CAPTURE_WIDTH 84
+#define CAPTURE_HEIGHT 48
+#define CAPTURE_QUEUE_SIZE 64
+#define MAX_CAPTURE_SCALE 16
+#define GIF_MAX_CODES 4096
 
 const char *game_over_text = " press R to restart ";
 const char *fps_text = "FPS: ";
@@ -80,8 +140,353 @@ typedef struct {
 
 typedef struct {
     float x, y;
+    uint8_t type;
 } brick_t;
 
+enum {
+    INPUT_LEFT = 1 << 0,
+    INPUT_RIGHT = 1 << 1,
+    INPUT_DOWN = 1 << 2,
+    INPUT_JUMP = 1 << 3,
+    INPUT_RESET = 1 << 4,
+    INPUT_MODE = 1 << 5,
+};
+
+#define NUM_KEYBOARD_PLAYERS 2
+
+typedef struct {
+    SDL_Scancode left, right, down, jump, alt_jump;
+} player_keys_t;
+
+const player_keys_t player_keys[NUM_KEYBOARD_PLAYERS] = {
+    {SDL_SCANCODE_A, SDL_SCANCODE_D, SDL_SCANCODE_S, SDL_SCANCODE_W, SDL_SCANCODE_SPACE},
+    {SDL_SCANCODE_LEFT, SDL_SCANCODE_RIGHT, SDL_SCANCODE_DOWN, SDL_SCANCODE_UP, SDL_SCANCODE_RCTRL},
+};
+
+typedef enum {
+    GAME_MODE_NORMAL,
+    GAME_MODE_MULTI_BALL,
+    NUM_GAME_MODES,
+} game_mode_t;
+
+// Best run files, saved in the pref path. A stage from a level pack gets its
+// own, named after a hash of its bricks, see ghost_path.
+const char *ghost_file_names[NUM_GAME_MODES] = {"ghost", "ghost_multi_ball"};
+const char *ghost_temp_file_name = "ghost.tmp";
+
+enum {
+    GHOST_BALL = 1 << 0,
+    GHOST_GROUNDED = 1 << 1,
+    GHOST_JUMPING = 1 << 2,
+};
+
+// One step of a ghost run with positions rounded to whole pixels. A ghost
+// file is a header ("UBGH", version, game mode, two zero bytes and the
+// little-endian score) followed by one flags byte per step and the change in
+// each position from the step before as a zigzag varint, usually one byte
+// each.
+typedef struct {
+    uint8_t flags;
+    int32_t player_x, player_y;
+    int32_t ball_x, ball_y; // the first ball
+} ghost_frame_t;
+
+typedef enum {
+    GHOST_START, // a run started, value is its game mode
+    GHOST_STEP,  // one step of the run, encoded as in the file
+    GHOST_SAVE,  // the run ended, value is its score
+} ghost_message_kind_t;
+
+// Sent by the simulation to whoever does the ghost file I/O.
+typedef struct {
+    ghost_message_kind_t kind;
+    uint32_t run;
+    uint32_t value;
+    uint8_t size;
+    uint8_t bytes[GHOST_MAX_STEP_SIZE];
+} ghost_message_t;
+
+// One step of the saved ghost, read ahead for the simulation.
+typedef struct {
+    uint32_t run; // the run it was read for
+    uint32_t step;
+    ghost_frame_t frame;
+} ghost_step_t;
+
+typedef enum {
+    REPLAY_STEP, // one step's input bits
+    REPLAY_NEXT, // a replay starts, value is its game mode
+    REPLAY_DONE, // every replay has been played
+} replay_entry_kind_t;
+
+// Read ahead from the replays for the simulation. The seed of an init()
+// comes with the step or replay start it follows.
+typedef struct {
+    replay_entry_kind_t kind;
+    uint8_t value;
+    bool has_seed;
+    uint32_t seed;
+} replay_entry_t;
+
+typedef enum {
+    SESSION_READY, // the step's input is set
+    SESSION_WAIT,  // the replay hasn't been read this far yet
+    SESSION_OVER,  // the replay has run out
+} session_status_t;
+
+// Everything the renderer needs to draw one frame. Published by the
+// simulation and only ever read by the renderer.
+typedef struct {
+    body_t player;
+    float camera_y;
+    bool ghost_visible;
+    ghost_frame_t ghost;
+    bool player_grounded;
+    bool player_jumping;
+    bool game_over;
+    uint32_t step;
+    uint32_t score;
+    uint32_t high_score;
+    int num_bricks;
+    brick_t bricks[MAX_VISIBLE_BRICKS];
+    int num_balls;
+    float ball_px[MAX_NUM_BALLS];
+    float ball_py[MAX_NUM_BALLS];
+    bool ball_squashed[MAX_NUM_BALLS];
+} render_state_t;
+
+// 1-bit coverage of a sprite or text, for drawing it into a capture.
+typedef struct {
+    int w, h;
+    uint8_t *bits; // one byte per pixel, nonzero where the sprite color is
+} mask_t;
+
+// One captured frame at the logical resolution: 0 for the background color
+// and 1 for the sprite color, the only two colors the game draws.
+typedef struct {
+    uint32_t step;
+    uint8_t pixels[CAPTURE_WIDTH * CAPTURE_HEIGHT];
+} capture_frame_t;
+
+typedef enum {
+    WAVE_PULSE,
+    WAVE_NOISE,
+} wave_t;
+
+// One note of a synthesized sound effect: a 1-bit pulse or noise wave that
+// sweeps linearly from start_hz to end_hz and fades out by decay/255 of its
+// volume over its length.
+typedef struct {
+    uint8_t wave;
+    uint8_t duty;      // high part of each period in 1/16ths (pulse only)
+    uint16_t start_hz;
+    uint16_t end_hz;
+    uint8_t length;    // 1/100 s
+    uint8_t volume;
+    uint8_t decay;
+} synth_note_t;
+
+// Sound effects, a few bytes of parameters each
+const synth_note_t jump_notes[] = {
+    // wave      duty  start  end   length  volume  decay
+    {WAVE_PULSE, 4,    330,   660,  9,      160,    96},
+};
+const synth_note_t bounce_start_notes[] = {
+    {WAVE_PULSE, 8,    220,   150,  5,      200,    160},
+};
+const synth_note_t bounce_end_notes[] = {
+    {WAVE_PULSE, 8,    440,   880,  6,      160,    128},
+};
+const synth_note_t brick_break_notes[] = {
+    {WAVE_NOISE, 0,    6000,  2000, 3,      120,    64},
+    {WAVE_PULSE, 4,    880,   1320, 6,      140,    200},
+};
+const synth_note_t game_over_notes[] = {
+    {WAVE_PULSE, 8,    523,   523,  12,     200,    64},
+    {WAVE_PULSE, 8,    415,   415,  12,     200,    64},
+    {WAVE_PULSE, 8,    349,   349,  12,     200,    64},
+    {WAVE_PULSE, 8,    262,   196,  50,     220,    255},
+};
+
+// Brick breaks climb a pentatonic scale as the score goes up
+const int brick_break_semitones[NUM_BRICK_BREAK_PITCHES] = {0, 2, 4, 7, 9, 12, 14, 16};
+
+typedef enum {
+    SOUND_JUMP,
+    SOUND_BOUNCE_START,
+    SOUND_BOUNCE_END,
+    SOUND_GAME_OVER,
+    SOUND_BRICK_BREAK, // one per pitch, NUM_BRICK_BREAK_PITCHES in total
+    NUM_SOUNDS = SOUND_BRICK_BREAK + NUM_BRICK_BREAK_PITCHES,
+} sound_id_t;
+
+// Mono samples, already at the device's rate and sample format.
+typedef struct {
+    int16_t *samples;
+    int length;
+    uint8_t priority; // higher priority sounds steal voices from lower ones
+} sound_t;
+
+typedef struct {
+    const sound_t *sound; // NULL when the voice is free
+    int position;
+    uint32_t started;     // start order, so the oldest voice is stolen first
+} voice_t;
+
+// Set on the shared triple buffer index when it holds a state the renderer
+// hasn't picked up yet.
+#define RENDER_STATE_FRESH 4
+
+// Indices of a single-producer/single-consumer ring. The storage is a
+// separate array of a power-of-two size owned by whoever declares the queue.
+typedef struct {
+    SDL_atomic_t head; // written by the producer only
+    SDL_atomic_t tail; // written by the consumer only
+} spsc_queue_t;
+
+typedef enum {
+    EFFECT_CLEAR,
+    EFFECT_BRICK_BREAK,
+    EFFECT_SQUASH,
+    EFFECT_LANDING,
+} effect_kind_t;
+
+// Visual effect requested by the simulation and spawned by the renderer.
+typedef struct {
+    effect_kind_t kind;
+    float x, y;
+} effect_t;
+
+// One game instance as the simulation sees it, plus the queues it shares
+// with its view.
+typedef struct {
+    bool left_pressed;
+    bool right_pressed;
+    bool down_pressed;
+    bool reset_pressed;
+    bool jump_pressed;
+    bool mode_pressed;
+    bool player_on_ground;
+    bool player_jumping;
+
+    uint32_t air_time;
+    uint32_t jump_time;
+    uint32_t time_since_jump_press;
+    uint32_t time_since_jump_release;
+
+    float camera_y;
+    float camera_focus_y;
+
+    body_t player;
+    float last_player_px;
+    float last_player_py;
+    int player_brick; // -1 when not standing on one
+
+    bool game_over;
+
+    game_mode_t game_mode;
+    uint32_t high_scores[NUM_GAME_MODES]; // since launch, so always on the one level given then
+    uint32_t score;
+
+    uint32_t steps;
+    uint32_t rng;        // xorshift32 state for rand_range
+    bool muted;          // its sounds aren't played
+    uint32_t last_input; // input of the last step taken
+
+    // Bricks of the current level, sorted by y. They point either into the
+    // mapped level pack or at the random level below and are never written
+    // through, so breaking one only sets its bit in brick_broken.
+    int num_bricks;
+    const float *brick_x;
+    const float *brick_y;
+    const uint8_t *brick_type;
+    uint32_t brick_broken[MAX_NUM_BRICKS / 32];
+
+    float random_brick_x[NUM_RANDOM_BRICKS];
+    float random_brick_y[NUM_RANDOM_BRICKS];
+    uint8_t random_brick_type[NUM_RANDOM_BRICKS];
+
+    // Per-ball state, one entry per live ball.
+    int num_balls;
+    float ball_px[MAX_NUM_BALLS];
+    float ball_py[MAX_NUM_BALLS];
+    float ball_vx[MAX_NUM_BALLS];
+    float ball_vy[MAX_NUM_BALLS];
+    float last_ball_py[MAX_NUM_BALLS];
+    bool ball_carried[MAX_NUM_BALLS];
+    bool ball_bouncing[MAX_NUM_BALLS];
+    uint32_t ball_carry_input[MAX_NUM_BALLS]; // left/right held when the carry started
+    float ball_carry_offset[MAX_NUM_BALLS];
+    uint32_t ball_carry_time[MAX_NUM_BALLS];
+    uint32_t ball_bounce_time[MAX_NUM_BALLS];
+    float stored_ball_vx[MAX_NUM_BALLS];
+    float stored_ball_vy[MAX_NUM_BALLS];
+    float stored_ball_py[MAX_NUM_BALLS];
+    int ball_hit_brick[MAX_NUM_BALLS];
+
+    // Replayed or recorded session, see update_session_files. The files and
+    // replay bookkeeping belong to the main thread, the simulation only sees
+    // the queues.
+    FILE *session_in, *session_out;
+    bool reading_replays;
+    int next_replay;
+    int num_replays_played;
+    bool replaying;         // input comes from replay_entries
+    bool replay_skipping;   // out of sync, so the rest of the replay is dropped
+    bool has_replay_seed;
+    uint32_t replay_seed;   // for the init() of the last entry taken
+    bool recording;
+    bool recording_dropped; // session_bytes filled up and the recording stopped
+    replay_entry_t replay_queue[REPLAY_QUEUE_SIZE];
+    spsc_queue_t replay_entries;
+    uint8_t session_byte_queue[SESSION_BYTE_QUEUE_SIZE];
+    spsc_queue_t session_bytes;
+
+    // Triple buffer between simulation and renderer. Each side owns one slot
+    // and the third is swapped through render_state_shared.
+    render_state_t render_states[3];
+    int render_state_write;
+    SDL_atomic_t render_state_shared;
+
+    SDL_atomic_t input_bits;
+
+    effect_t effect_queue[EFFECT_QUEUE_SIZE];
+    spsc_queue_t effects;
+
+    // Best run ghost, see update_ghost_files
+    bool has_ghost;
+    uint32_t ghost_run; // counts runs, so steps read for an earlier one are dropped
+    uint32_t ghost_step;
+    bool ghost_recording;
+    bool ghost_visible;
+    ghost_frame_t ghost_frame;     // the ghost's current step
+    ghost_frame_t ghost_out_frame; // last step queued
+    ghost_message_t ghost_queue[GHOST_QUEUE_SIZE];
+    spsc_queue_t ghost_messages;
+    ghost_step_t ghost_step_queue[GHOST_STEP_QUEUE_SIZE];
+    spsc_queue_t ghost_steps;
+} game_t;
+
+// The renderer's side of a game instance.
+typedef struct {
+    game_t *game;
+    SDL_Rect viewport; // where it's drawn, in the window's logical pixels
+    int render_state_read;
+
+    // Particle pool. Live particles are packed at the front of the arrays so
+    // the update loops run over contiguous floats.
+    float particle_px[MAX_NUM_PARTICLES];
+    float particle_py[MAX_NUM_PARTICLES];
+    float particle_vx[MAX_NUM_PARTICLES];
+    float particle_vy[MAX_NUM_PARTICLES];
+    float particle_gravity[MAX_NUM_PARTICLES];
+    float particle_drag[MAX_NUM_PARTICLES];
+    float particle_life[MAX_NUM_PARTICLES];
+    int num_particles;
+    uint32_t particle_rng;
+    uint32_t last_particle_step; // step of the state particles were last moved to
+} view_t;
+
 bool check_collision_circle_rect(float, float, float, float, float, float, float);
 bool check_collision_rect_rect(float, float, float, float, float, float, float, float);
 
@@ -89,63 +494,103 @@ float accelerate(float);
 float decelerate(float);
 float pivot(float);
 
-float rand_range(float, float);
+float xorshift_range(uint32_t *, float, float);
+float rand_range(game_t *, float, float);
 float positive_fmod(float, float);
+float wrapped_delta(float);
 
-int next_brick;
+void spawn_ball(game_t *, float, float, float, float);
 
-uint32_t last_fps_update_time;
-float last_ball_px;
-float last_ball_py;
-float last_player_px;
-float last_player_py;
-
-bool left_pressed;
-bool right_pressed;
-bool down_pressed;
-bool show_fps_pressed;
-bool toggle_fullscreen_pressed;
-bool reset_pressed;
-bool jump_pressed;
-bool player_on_ground;
-bool player_carrying_ball;
-bool player_jumping;
-bool ball_bouncing;
+int spsc_reserve(spsc_queue_t *, int);
+void spsc_commit(spsc_queue_t *);
+int spsc_peek(spsc_queue_t *, int);
+void spsc_release(spsc_queue_t *);
+bool spsc_empty(spsc_queue_t *);
 
-bool left_pressed_entering_carry_state;
-bool right_pressed_entering_carry_state;
+void emit_effect(game_t *, effect_kind_t, float, float);
+void play_sound(game_t *, sound_id_t);
 
-float player_carry_offset;
-float stored_ball_vx;
-float stored_ball_vy;
-float stored_ball_py;
+void start_ghost(game_t *);
+void update_ghost(game_t *);
+void save_ghost(game_t *);
+void update_ghost_files(game_t *);
 
-uint32_t ball_carry_time;
-uint32_t ball_bounce_time;
-uint32_t air_time;
-uint32_t jump_time;
-uint32_t time_since_jump_press;
-uint32_t time_since_jump_release;
+uint32_t session_seed(game_t *, uint32_t);
+void update_session_files(game_t *);
 
-float camera_y;
-float camera_focus_y;
+void unload_level_pack();
+uint32_t hash_stage(const level_pack_stage_t *);
 
-brick_t *player_brick;
-brick_t *hit_brick;
+void acquire_assets();
+void release_assets();
+bool create_game(int);
+void destroy_game(int);
 
-bool game_over;
+void wake_simulation();
+bool settle_audio(bool);
+void resume_audio();
 
-uint32_t high_score;
-uint32_t score;
+uint32_t last_fps_update_time;
 
-struct timeval tv;
+bool show_fps_pressed;
+bool toggle_fullscreen_pressed;
 
-body_t ball, player;
+struct timeval tv;
 
-brick_t bricks[MAX_NUM_BRICKS];
+// Game instances. Each has its own simulation state in games and its own
+// place in the window and particles in views; what they draw and play comes
+// from the one set of shared assets. Both arrays are allocated for num_games
+// at startup, a view's particle pool alone is a few megabytes. Everything
+// that works on one instance takes it as its first argument.
+game_t *games;
+view_t *views;
+int num_games = 1;
+int grid_columns = 1;
+int grid_rows = 1;
+
+// Level pack, mapped read-only so its pages are shared with every other
+// process playing it.
+const uint8_t *level_pack;
+size_t level_pack_size;
+const level_pack_stage_t *level_stage; // NULL for a random level
+uint32_t level_stage_hash;
+
+// Uniform grid over the visible part of the play field, rebuilt every step.
+// Columns wrap around with the screen; rows start just below the camera and
+// anything outside them is clamped into the first or last row. Bricks are
+// binned by their bottom left corner and balls by their center. Games are
+// stepped one at a time, so they share it.
+float grid_bottom;
+int grid_first_brick; // brick items are numbered from here
+int brick_cells[MAX_NUM_BRICKS];
+int brick_cell_start[NUM_GRID_CELLS + 1];
+int brick_cell_items[MAX_NUM_BRICKS];
+int ball_cells[MAX_NUM_BALLS];
+int ball_cell_start[NUM_GRID_CELLS + 1];
+int ball_cell_items[MAX_NUM_BALLS];
+int grid_query_results[MAX_NUM_BALLS + MAX_NUM_BRICKS];
+
+SDL_Thread *sim_thread;
+
+// Idle mode. While every game is over or the window is in the background the
+// simulation sleeps on sim_wake and the main thread blocks waiting for events.
+// The simulation pushes sim_event when game over changes so the main thread
+// notices without polling.
+SDL_sem *sim_wake;
+SDL_atomic_t sim_paused;
+Uint32 sim_event;
+bool needs_redraw = true;
+
+SDL_Rect particle_rects[2 * MAX_NUM_PARTICLES];
+SDL_Rect solid_brick_rects[2 * MAX_VISIBLE_BRICKS];
 
 SDL_Window *win;
 SDL_Renderer *renderer;
+
+// Assets, shared by every game instance. Each game holds a reference from
+// create_game to destroy_game: the first one loads them and the last one
+// frees them, so there's only ever one copy however many games are running.
+int asset_refs;
 SDL_Surface *loading_surf;
 SDL_Texture *ball_texture, *ball_squash_texture, *player_texture, *player_jump_texture, *player_fall_texture, *brick_texture;
 SDL_Texture *white_on_black_number_textures[10];
@@ -153,197 +598,292 @@ SDL_Texture *score_number_textures[10];
 SDL_Texture *highscore_number_textures[10];
 SDL_Texture *game_over_text_texture;
 SDL_Texture *fps_text_texture;
-Mix_Chunk *sfx_jump, *sfx_game_over, *sfx_bounce_start, *sfx_bounce_end, *sfx_brick_break;
+mask_t ball_mask, ball_squash_mask, player_mask, player_jump_mask, player_fall_mask, brick_mask;
+mask_t number_masks[10];
+mask_t game_over_text_mask;
+sound_t sounds[NUM_SOUNDS];
 TTF_Font *font;
 
+// Best run ghost. The run in progress is streamed to a temporary file that
+// replaces the saved ghost if it scores higher, and the saved ghost is read
+// back a step at a time, so memory use doesn't grow with the run. Only kept
+// when there's a single game.
+//
+// The simulation never touches the files. It queues each step of the run on
+// the game's ghost_messages, and update_ghost_files() on the main thread
+// writes them and reads the saved ghost a few seconds ahead into its
+// ghost_steps.
+char *pref_path;
+
+// File side. The simulation side is in the game with has_ghost set, and as
+// there's only one set of files, only games[0] can have it.
+FILE *ghost_in, *ghost_out;
+char ghost_in_buffer[GHOST_BUFFER_SIZE];
+char ghost_out_buffer[GHOST_BUFFER_SIZE];
+game_mode_t ghost_in_mode;
+game_mode_t ghost_out_mode;
+uint32_t ghost_in_score;
+bool ghost_reading;
+uint32_t ghost_in_run;
+uint32_t ghost_in_step;
+ghost_frame_t ghost_in_frame; // last step read from ghost_in
+
+// Recorded sessions. A session file is "UBRS", a version byte, the game mode
+// and two zero bytes, followed by one byte of input bits per simulation step.
+// The seed used by each init() follows the step that caused it as
+// SESSION_SEED and four little-endian bytes, so a replay is exact.
+const char *replay_paths[MAX_NUM_REPLAYS];
+int num_replays;
+bool replay_failed;
+bool loop_replays;     // with several games, they play the replays over and over
+int num_games_playing; // headless runs end when every game is out of replays
+
+// Headless mode replays sessions unpaced with a software renderer and times
+// every frame. There's no headless mode on the web.
+bool headless;
+uint32_t num_steps;
+#ifndef __EMSCRIPTEN__
+float frame_times[MAX_PERF_FRAMES]; // us
+int num_frame_times;
+// Each pass replays the sessions from the start. The frames of pass i are
+// frame_times[perf_pass_start[i]] up to perf_pass_start[i + 1].
+int perf_pass_start[MAX_PERF_PASSES + 1];
+uint32_t perf_pass_steps[MAX_PERF_PASSES];
+double perf_pass_seconds[MAX_PERF_PASSES];
+int num_perf_passes;
+#endif
+
+// Gameplay capture. render() draws each new step into a logical frame in
+// capture_queue as well as on screen, and the capture thread encodes the
+// frames to a GIF or raw video, so the main loop never waits on the disk.
+// Only headless runs wait for a free slot; interactively a frame is dropped
+// and the next one covers for it.
+FILE *capture_file;
+bool capture_gif;
+int capture_scale = 1;
+capture_frame_t capture_queue[CAPTURE_QUEUE_SIZE];
+spsc_queue_t captures;
+SDL_sem *capture_ready; // posted for each queued frame and to stop
+SDL_atomic_t capture_stopping;
+SDL_Thread *capture_worker;
+uint8_t *capture_pixels; // frame render() is drawing into, NULL if none
+uint32_t last_capture_step = UINT32_MAX;
+uint32_t captures_dropped;
+
+// Encoder state, owned by the capture thread
+capture_frame_t pending_capture; // GIF frames wait for the next to know their delay
+bool has_pending_capture;
+uint8_t capture_canvas[CAPTURE_WIDTH * CAPTURE_HEIGHT]; // what the GIF shows so far
+uint32_t capture_last_step;
+uint32_t num_captures_written;
+uint16_t gif_codes[GIF_MAX_CODES][2]; // LZW string + pixel -> code, 0 if none
+uint8_t gif_block[255];
+int gif_block_size;
+uint32_t gif_bits;
+int gif_num_bits;
+
+// Audio. The simulation queues sounds and the audio callback, which owns
+// the voices, starts and mixes them.
+SDL_AudioDeviceID audio_device;
+SDL_AudioSpec audio_spec;
+int audio_buffer_frames = 512;
+voice_t voices[MAX_NUM_VOICES];
+uint32_t voices_started;
+int32_t audio_mix_buffer[MAX_AUDIO_FRAMES];
+uint8_t audio_queue[AUDIO_QUEUE_SIZE];
+spsc_queue_t audio_commands;
+SDL_atomic_t audio_busy_voices; // left playing after the last callback
+bool audio_paused;
+
 int glyph_width, glyph_height;
 int game_over_text_width, game_over_text_height;
 int fps_text_width, fps_text_height;
 
-bool should_quit = false;
+SDL_atomic_t should_quit;
 bool fullscreen = false;
 
 uint32_t frames = 0;
 uint32_t fps = 0;
 bool show_fps = false;
 
-void init() {
-    gettimeofday(&tv, NULL);
-    srand((uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000);
-    float start_x = rand_range(12.8f * scale, screen_width - 12.8f * scale);
-    float start_y = 6.4f * scale;
-
-    ball = (body_t){
-        .px = start_x,
-        .py = start_y + player_height * 6.0f,
-    };
-
-    player = (body_t){
-        .px = start_x - player_width * 0.5f,
-        .py = start_y + player_height * 2.0f,
-    };
-
-    memset(bricks, 0, MAX_NUM_BRICKS * sizeof(brick_t));
-
-    bricks[0].x = start_x - brick_width / 2.0f;
-    bricks[0].y = start_y;
-    bricks[1].x = start_x - brick_width * 3.0f / 2.0f;
-    bricks[1].y = start_y;
-    bricks[2].x = start_x + brick_width / 2.0f;
-    bricks[2].y = start_y;
-
-    // bricks[0].x = start_x - 6.0f * scale;
-    // bricks[0].y = start_y + 6.0f * scale;
-    // bricks[1].x = start_x;
-    // bricks[1].y = start_y + 6.0f * scale;
+// Random level of platforms of three bricks, each a little higher than the
+// last.
+void generate_level(game_t *game, float start_x, float start_y) {
+    game->random_brick_x[0] = start_x - brick_width / 2.0f;
+    game->random_brick_y[0] = start_y;
+    game->random_brick_x[1] = start_x - brick_width * 3.0f / 2.0f;
+    game->random_brick_y[1] = start_y;
+    game->random_brick_x[2] = start_x + brick_width / 2.0f;
+    game->random_brick_y[2] = start_y;
+
+    // random_brick_x[0] = start_x - 6.0f * scale;
+    // random_brick_y[0] = start_y + 6.0f * scale;
+    // random_brick_x[1] = start_x;
+    // random_brick_y[1] = start_y + 6.0f * scale;
 
     float last_x = start_x;
     float last_y = start_y;
 
     {
         int i = 3;
-        float x = rand_range(start_x + 3.0f * brick_width, start_x + 6.0f * brick_width);
-        float y = last_y + rand_range(0.5f * player_height, 1.5f * player_height);
+        float x = rand_range(game, start_x + 3.0f * brick_width, start_x + 6.0f * brick_width);
+        float y = last_y + rand_range(game, 0.5f * player_height, 1.5f * player_height);
         last_x = x;
         last_y = y;
-        bricks[i].x = last_x - brick_width / 2.0f;
-        bricks[i].y = last_y;
-        bricks[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
-        bricks[i + 1].y = last_y;
-        bricks[i + 2].x = last_x + brick_width / 2.0f;
-        bricks[i + 2].y = last_y;
+        game->random_brick_x[i] = last_x - brick_width / 2.0f;
+        game->random_brick_y[i] = last_y;
+        game->random_brick_x[i + 1] = last_x - brick_width * 3.0f / 2.0f;
+        game->random_brick_y[i + 1] = last_y;
+        game->random_brick_x[i + 2] = last_x + brick_width / 2.0f;
+        game->random_brick_y[i + 2] = last_y;
     }
 
     {
         int i = 6;
-        float x = rand_range(start_x - 9.0f * brick_width, start_x - 6.0f * brick_width);
-        float y = last_y + rand_range(0.5f * player_height, 1.5f * player_height);
+        float x = rand_range(game, start_x - 9.0f * brick_width, start_x - 6.0f * brick_width);
+        float y = last_y + rand_range(game, 0.5f * player_height, 1.5f * player_height);
         last_x = x;
         last_y = y;
-        bricks[i].x = last_x - brick_width / 2.0f;
-        bricks[i].y = last_y;
-        bricks[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
-        bricks[i + 1].y = last_y;
-        bricks[i + 2].x = last_x + brick_width / 2.0f;
-        bricks[i + 2].y = last_y;
+        game->random_brick_x[i] = last_x - brick_width / 2.0f;
+        game->random_brick_y[i] = last_y;
+        game->random_brick_x[i + 1] = last_x - brick_width * 3.0f / 2.0f;
+        game->random_brick_y[i + 1] = last_y;
+        game->random_brick_x[i + 2] = last_x + brick_width / 2.0f;
+        game->random_brick_y[i + 2] = last_y;
     }
 
     {
         int i = 9;
-        float x = rand_range(start_x + 6.0f * brick_width, start_x + 8.0f * brick_width);
-        float y = last_y + rand_range(0.5f * player_height, 1.5f * player_height);
+        float x = rand_range(game, start_x + 6.0f * brick_width, start_x + 8.0f * brick_width);
+        float y = last_y + rand_range(game, 0.5f * player_height, 1.5f * player_height);
         last_x = x;
         last_y = y;
-        bricks[i].x = last_x - brick_width / 2.0f;
-        bricks[i].y = last_y;
-        bricks[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
-        bricks[i + 1].y = last_y;
-        bricks[i + 2].x = last_x + brick_width / 2.0f;
-        bricks[i + 2].y = last_y;
-    }
-
-    for (int i = 12; i < 255; i += 3) {
-        float x = rand_range(0.0f, 1.0f) > 0.5f 
-            ? rand_range(last_x + 3.0f * brick_width, last_x + 6.0f * brick_width) 
-            : rand_range(last_x - 8.0f * brick_width, last_x - 6.0f * brick_width);
-        float y = last_y + rand_range(0.5f * player_height, 1.5f * player_height);
+        game->random_brick_x[i] = last_x - brick_width / 2.0f;
+        game->random_brick_y[i] = last_y;
+        game->random_brick_x[i + 1] = last_x - brick_width * 3.0f / 2.0f;
+        game->random_brick_y[i + 1] = last_y;
+        game->random_brick_x[i + 2] = last_x + brick_width / 2.0f;
+        game->random_brick_y[i + 2] = last_y;
+    }
+
+    for (int i = 12; i < NUM_RANDOM_BRICKS; i += 3) {
+        float x = rand_range(game, 0.0f, 1.0f) > 0.5f 
+            ? rand_range(game, last_x + 3.0f * brick_width, last_x + 6.0f * brick_width) 
+            : rand_range(game, last_x - 8.0f * brick_width, last_x - 6.0f * brick_width);
+        float y = last_y + rand_range(game, 0.5f * player_height, 1.5f * player_height);
         last_x = x;
         last_y = y;
-        bricks[i].x = last_x - brick_width / 2.0f;
-        bricks[i].y = last_y;
-        bricks[i + 1].x = last_x - brick_width * 3.0f / 2.0f;
-        bricks[i + 1].y = last_y;
-        bricks[i + 2].x = last_x + brick_width / 2.0f;
-        bricks[i + 2].y = last_y;
+        game->random_brick_x[i] = last_x - brick_width / 2.0f;
+        game->random_brick_y[i] = last_y;
+        game->random_brick_x[i + 1] = last_x - brick_width * 3.0f / 2.0f;
+        game->random_brick_y[i + 1] = last_y;
+        game->random_brick_x[i + 2] = last_x + brick_width / 2.0f;
+        game->random_brick_y[i + 2] = last_y;
     }
 
-    
-    next_brick = 0;
-
-    last_fps_update_time = 0;
-    last_ball_px = 0.0f;
-    last_ball_py = 0.0f;
-    last_player_px = 0.0f;
-    last_player_py = 0.0f;
-
-    left_pressed = false;
-    right_pressed = false;
-    down_pressed = false;
-    show_fps_pressed = false;
-    toggle_fullscreen_pressed = false;
-    player_on_ground = false;
-    player_carrying_ball = false;
-    player_jumping = false;
-    ball_bouncing = false;
-    left_pressed_entering_carry_state = false;
-    right_pressed_entering_carry_state = false;
-
-    player_carry_offset = 0.0f;
-    stored_ball_vx = 0.0f;
-    stored_ball_vy = 0.0f;
-    stored_ball_py = 0.0f;
-    ball_carry_time = 0;
-    ball_bounce_time = 0;
-    air_time = 0;
-    jump_time = 0;
-    time_since_jump_press = max_time;
-    time_since_jump_release = max_time - 1;
-
-    camera_y = 0.0f;
-    camera_focus_y = bricks[0].y;
-
-    player_brick = NULL;
-    hit_brick = NULL;
-
-    game_over = false;
-
-    score = 0;
+    game->num_bricks = NUM_RANDOM_BRICKS;
+    game->brick_x = game->random_brick_x;
+    game->brick_y = game->random_brick_y;
+    game->brick_type = game->random_brick_type;
 }
 
-void one_iter() {
-    SDL_Event e;
-    if (SDL_PollEvent(&e)) {
-        if (e.type == SDL_QUIT) {
-            should_quit = true;
-            return;
-        }
+void init(game_t *game) {
+    gettimeofday(&tv, NULL);
+    game->rng = session_seed(game, (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000);
+    if (game->rng == 0) {
+        game->rng = 1;
     }
-
-    frames++;
-    uint32_t ticks = SDL_GetTicks();
-    uint32_t delta = ticks - last_fps_update_time;
-    if (delta > 200) {
-        fps = (float)frames / (float)delta * 1000.0f;
-        last_fps_update_time = ticks;
-        frames = 0;
+    float start_x, start_y;
+    if (level_stage != NULL) {
+        start_x = level_stage->start_x;
+        start_y = level_stage->start_y;
+    } else {
+        start_x = rand_range(game, 12.8f * scale, screen_width - 12.8f * scale);
+        start_y = 6.4f * scale;
     }
 
-    const Uint8 *keystates = SDL_GetKeyboardState(NULL);
-    left_pressed = keystates[SDL_SCANCODE_A] || keystates[SDL_SCANCODE_LEFT];
-    right_pressed = keystates[SDL_SCANCODE_D] || keystates[SDL_SCANCODE_RIGHT];
-    down_pressed = keystates[SDL_SCANCODE_S] || keystates[SDL_SCANCODE_DOWN];
+    game->num_balls = 0;
+    spawn_ball(game, start_x, start_y + player_height * 6.0f, 0.0f, 0.0f);
 
-    if (!reset_pressed && keystates[SDL_SCANCODE_R]) {
-        reset_pressed = keystates[SDL_SCANCODE_R];
-        init();
-        return;
-    } else if (reset_pressed && !keystates[SDL_SCANCODE_R]) {
-        reset_pressed = keystates[SDL_SCANCODE_R];
+    game->player = (body_t){
+        .px = start_x - player_width * 0.5f,
+        .py = start_y + player_height * 2.0f,
+    };
+
+    if (level_stage != NULL) {
+        const level_pack_header_t *header = (const level_pack_header_t *)level_pack;
+        game->num_bricks = level_stage->num_bricks;
+        game->brick_x = (const float *)(level_pack + header->brick_x_offset) + level_stage->first_brick;
+        game->brick_y = (const float *)(level_pack + header->brick_y_offset) + level_stage->first_brick;
+        game->brick_type = level_pack + header->brick_type_offset + level_stage->first_brick;
+    } else {
+        generate_level(game, start_x, start_y);
     }
+    memset(game->brick_broken, 0, (game->num_bricks + 31) / 32 * sizeof(uint32_t));
+
+    if (game->game_mode == GAME_MODE_MULTI_BALL) {
+        for (uint32_t i = 1; i < multi_ball_start_count; i++) {
+            spawn_ball(game, start_x + rand_range(game, -3.0f, 3.0f) * brick_width,
+                       start_y + player_height * rand_range(game, 4.0f, 10.0f),
+                       rand_range(game, -1.0f, 1.0f) * ball_light_bounce_vx, 0.0f);
+        }
+    }
+
+    game->last_player_px = 0.0f;
+    game->last_player_py = 0.0f;
+
+    game->left_pressed = false;
+    game->right_pressed = false;
+    game->down_pressed = false;
+    game->player_on_ground = false;
+    game->player_jumping = false;
+
+    game->air_time = 0;
+    game->jump_time = 0;
+    game->time_since_jump_press = max_time;
+    game->time_since_jump_release = max_time - 1;
+
+    game->camera_y = 0.0f;
+    game->camera_focus_y = start_y;
+
+    game->player_brick = -1;
 
-    bool jump_keystates = keystates[SDL_SCANCODE_SPACE] || keystates[SDL_SCANCODE_W];
-    if (!jump_pressed && jump_keystates) {
-        jump_pressed = jump_keystates;
-        time_since_jump_press = 0;
-    } else if (jump_pressed && !jump_keystates) {
-        jump_pressed = jump_keystates;
-        time_since_jump_release = 0;
+    game->game_over = false;
+
+    game->score = 0;
+
+    start_ghost(game);
+
+    emit_effect(game, EFFECT_CLEAR, 0.0f, 0.0f);
+}
+
+// Sample events and keyboard on the main thread. Window-level toggles are
+// handled here; gameplay keys are packed into bits for the simulation.
+void poll_input() {
+    SDL_Event e;
+    while (SDL_PollEvent(&e)) {
+        if (e.type == SDL_QUIT) {
+            SDL_AtomicSet(&should_quit, 1);
+            wake_simulation();
+        } else if (e.type == SDL_WINDOWEVENT) {
+            switch (e.window.event) {
+            case SDL_WINDOWEVENT_SHOWN:
+            case SDL_WINDOWEVENT_EXPOSED:
+            case SDL_WINDOWEVENT_SIZE_CHANGED:
+            case SDL_WINDOWEVENT_RESTORED:
+                needs_redraw = true;
+                break;
+            }
+        }
     }
 
+    const Uint8 *keystates = SDL_GetKeyboardState(NULL);
+
     bool show_fps_keystates = keystates[SDL_SCANCODE_P];
     if (!show_fps_pressed && show_fps_keystates) {
         show_fps_pressed = true;
         show_fps = !show_fps;
+        needs_redraw = true;
     } else if (show_fps_pressed && !show_fps_keystates) {
         show_fps_pressed = false;
     }
@@ -352,6 +892,7 @@ void one_iter() {
     if (!toggle_fullscreen_pressed && toggle_fullscreen_keystates) {
         toggle_fullscreen_pressed = true;
         fullscreen = !fullscreen;
+        needs_redraw = true;
         if (fullscreen) {
             SDL_SetWindowFullscreen(win, SDL_WINDOW_FULLSCREEN_DESKTOP);
         } else {
@@ -361,401 +902,2325 @@ void one_iter() {
         toggle_fullscreen_pressed = false;
     }
 
-    if (game_over) {
+    // Restart and mode switch are for everyone. A single game can be played
+    // with either player's keys, otherwise the first two games get one
+    // player each.
+    uint32_t shared_input = 0;
+    if (keystates[SDL_SCANCODE_R]) {
+        shared_input |= INPUT_RESET;
+    }
+    if (keystates[SDL_SCANCODE_M]) {
+        shared_input |= INPUT_MODE;
+    }
+    bool changed = false;
+    for (int i = 0; i < num_games; i++) {
+        uint32_t input = shared_input;
+        for (int p = 0; p < NUM_KEYBOARD_PLAYERS; p++) {
+            const player_keys_t *keys = &player_keys[p];
+            if (num_games > 1 && p != i) {
+                continue;
+            }
+            if (keystates[keys->left]) {
+                input |= INPUT_LEFT;
+            }
+            if (keystates[keys->right]) {
+                input |= INPUT_RIGHT;
+            }
+            if (keystates[keys->down]) {
+                input |= INPUT_DOWN;
+            }
+            if (keystates[keys->jump] || keystates[keys->alt_jump]) {
+                input |= INPUT_JUMP;
+            }
+        }
+        if ((uint32_t)SDL_AtomicSet(&games[i].input_bits, input) != input) {
+            changed = true;
+        }
+    }
+    if (changed) {
+        wake_simulation();
+    }
+}
+
+// Let a sleeping simulation thread re-check whether it has work to do.
+void wake_simulation() {
+    if (sim_wake != NULL && SDL_SemValue(sim_wake) == 0) {
+        SDL_SemPost(sim_wake);
+    }
+}
+
+// Pause the audio device once everything has finished playing, or straight
+// away if pause_now is set. Returns whether sounds are still playing.
+bool settle_audio(bool pause_now) {
+    if (audio_paused) {
+        return false;
+    }
+    bool busy = SDL_AtomicGet(&audio_busy_voices) > 0 || !spsc_empty(&audio_commands);
+    if (busy && !pause_now) {
+        return true;
+    }
+    SDL_PauseAudioDevice(audio_device, 1);
+    audio_paused = true;
+    return false;
+}
+
+void resume_audio() {
+    if (audio_paused) {
+        SDL_PauseAudioDevice(audio_device, 0);
+        audio_paused = false;
+    }
+}
+
+void spawn_ball(game_t *game, float px, float py, float vx, float vy) {
+    if (game->num_balls == MAX_NUM_BALLS) {
+        return;
+    }
+    int i = game->num_balls++;
+    game->ball_px[i] = px;
+    game->ball_py[i] = py;
+    game->ball_vx[i] = vx;
+    game->ball_vy[i] = vy;
+    game->last_ball_py[i] = py;
+    game->ball_carried[i] = false;
+    game->ball_bouncing[i] = false;
+    game->ball_carry_input[i] = 0;
+    game->ball_carry_offset[i] = 0.0f;
+    game->ball_carry_time[i] = 0;
+    game->ball_bounce_time[i] = 0;
+    game->stored_ball_vx[i] = 0.0f;
+    game->stored_ball_vy[i] = 0.0f;
+    game->stored_ball_py[i] = 0.0f;
+    game->ball_hit_brick[i] = -1;
+}
+
+// Remove a ball by moving the last one into its place.
+void remove_ball(game_t *game, int i) {
+    int last = --game->num_balls;
+    game->ball_px[i] = game->ball_px[last];
+    game->ball_py[i] = game->ball_py[last];
+    game->ball_vx[i] = game->ball_vx[last];
+    game->ball_vy[i] = game->ball_vy[last];
+    game->last_ball_py[i] = game->last_ball_py[last];
+    game->ball_carried[i] = game->ball_carried[last];
+    game->ball_bouncing[i] = game->ball_bouncing[last];
+    game->ball_carry_input[i] = game->ball_carry_input[last];
+    game->ball_carry_offset[i] = game->ball_carry_offset[last];
+    game->ball_carry_time[i] = game->ball_carry_time[last];
+    game->ball_bounce_time[i] = game->ball_bounce_time[last];
+    game->stored_ball_vx[i] = game->stored_ball_vx[last];
+    game->stored_ball_vy[i] = game->stored_ball_vy[last];
+    game->stored_ball_py[i] = game->stored_ball_py[last];
+    game->ball_hit_brick[i] = game->ball_hit_brick[last];
+}
+
+bool is_brick_broken(game_t *game, int b) {
+    return game->brick_broken[b / 32] >> (b % 32) & 1;
+}
+
+// First brick with a y of at least y, by binary search.
+int find_brick(game_t *game, float y) {
+    int first = 0;
+    int last = game->num_bricks;
+    while (first < last) {
+        int middle = (first + last) / 2;
+        if (game->brick_y[middle] < y) {
+            first = middle + 1;
+        } else {
+            last = middle;
+        }
+    }
+    return first;
+}
+
+// Break the brick a ball has finished squashing against.
+void break_brick(game_t *game, int i) {
+    int b = game->ball_hit_brick[i];
+    game->ball_hit_brick[i] = -1;
+    if (is_brick_broken(game, b)) {
+        // Another ball got to it first
+        return;
+    }
+    if (game->brick_type[b] == BRICK_SOLID) {
+        return;
+    }
+
+    emit_effect(game, EFFECT_BRICK_BREAK, game->brick_x[b], game->brick_y[b]);
+    if (game->game_mode == GAME_MODE_MULTI_BALL) {
+        for (uint32_t j = 0; j < multi_ball_split_count; j++) {
+            spawn_ball(game, game->ball_px[i] + rand_range(game, -1.0f, 1.0f) * ball_radius, game->ball_py[i] + ball_radius,
+                       rand_range(game, -1.0f, 1.0f) * ball_bounce_vx, rand_range(game, 0.5f, 1.0f) * ball_bounce_vy);
+        }
+    }
+    game->brick_broken[b / 32] |= 1u << (b % 32);
+    play_sound(game, SOUND_BRICK_BREAK + game->score % NUM_BRICK_BREAK_PITCHES);
+    game->score++;
+    if (game->score > game->high_scores[game->game_mode]) {
+        game->high_scores[game->game_mode] = game->score;
+    }
+}
+
+int grid_column(float x) {
+    int column = (int)(positive_fmod(x, screen_width) * GRID_COLUMNS / screen_width);
+    return column < GRID_COLUMNS ? column : GRID_COLUMNS - 1;
+}
+
+int grid_row(float y) {
+    float row = floorf((y - grid_bottom) / grid_cell_height);
+    return row < 0.0f ? 0 : row >= GRID_ROWS ? GRID_ROWS - 1 : (int)row;
+}
+
+// Counting sort of items into cells. Items with a cell of -1 are left out.
+void fill_grid(int num_items, const int *cells, int *cell_start, int *cell_items) {
+    memset(cell_start, 0, (NUM_GRID_CELLS + 1) * sizeof(int));
+    for (int i = 0; i < num_items; i++) {
+        if (cells[i] >= 0) {
+            cell_start[cells[i] + 1]++;
+        }
+    }
+    for (int c = 0; c < NUM_GRID_CELLS; c++) {
+        cell_start[c + 1] += cell_start[c];
+    }
+    // Use each cell's start as its insertion cursor, which leaves it at the
+    // start of the next cell, then shift everything back by one
+    for (int i = 0; i < num_items; i++) {
+        if (cells[i] >= 0) {
+            cell_items[cell_start[cells[i]]++] = i;
+        }
+    }
+    for (int c = NUM_GRID_CELLS; c > 0; c--) {
+        cell_start[c] = cell_start[c - 1];
+    }
+    cell_start[0] = 0;
+}
+
+void build_grids(game_t *game) {
+    grid_bottom = game->camera_y - grid_cell_height;
+
+    // Bricks below the screen don't have collision, and neither do the ones
+    // above the highest thing that could land on them
+    float top = game->player.py + player_height;
+    for (int i = 0; i < game->num_balls; i++) {
+        top = fmax(top, game->ball_py[i] + ball_radius);
+    }
+    grid_first_brick = find_brick(game, game->camera_y - brick_height);
+    int num_grid_bricks = find_brick(game, top + 1.0f) - grid_first_brick;
+    for (int i = 0; i < num_grid_bricks; i++) {
+        int b = grid_first_brick + i;
+        brick_cells[i] = is_brick_broken(game, b) ? -1 : grid_row(game->brick_y[b]) * GRID_COLUMNS + grid_column(game->brick_x[b]);
+    }
+    fill_grid(num_grid_bricks, brick_cells, brick_cell_start, brick_cell_items);
+
+    for (int i = 0; i < game->num_balls; i++) {
+        ball_cells[i] = grid_row(game->ball_py[i]) * GRID_COLUMNS + grid_column(game->ball_px[i]);
+    }
+    fill_grid(game->num_balls, ball_cells, ball_cell_start, ball_cell_items);
+}
+
+// Collect every item binned in the cells overlapping [x0, x1] x [y0, y1].
+// Each item lives in exactly one cell, so there are no duplicates.
+int query_grid(float x0, float x1, float y0, float y1, const int *cell_start, const int *cell_items) {
+    int first_column = grid_column(x0);
+    int num_columns = (grid_column(x1) - first_column + GRID_COLUMNS) % GRID_COLUMNS + 1;
+    if (x1 - x0 >= screen_width) {
+        num_columns = GRID_COLUMNS;
+    }
+    int last_row = grid_row(y1);
+
+    int n = 0;
+    for (int row = grid_row(y0); row <= last_row; row++) {
+        for (int c = 0; c < num_columns; c++) {
+            int cell = row * GRID_COLUMNS + (first_column + c) % GRID_COLUMNS;
+            for (int k = cell_start[cell]; k < cell_start[cell + 1]; k++) {
+                grid_query_results[n++] = cell_items[k];
+            }
+        }
+    }
+    return n;
+}
+
+bool check_collision_ball_rect(game_t *game, int i, float x, float y, float w, float h) {
+    return check_collision_circle_rect(positive_fmod(game->ball_px[i], (float)screen_width), game->ball_py[i], ball_radius,
+                                       positive_fmod(x, (float)screen_width), y, w, h) ||
+           check_collision_circle_rect(positive_fmod(game->ball_px[i], (float)screen_width) - screen_width, game->ball_py[i], ball_radius,
+                                       positive_fmod(x, (float)screen_width), y, w, h) ||
+           check_collision_circle_rect(positive_fmod(game->ball_px[i], (float)screen_width), game->ball_py[i], ball_radius,
+                                       positive_fmod(x, (float)screen_width) - screen_width, y, w, h);
+}
+
+// Push two overlapping free balls apart and exchange their velocities along
+// the contact normal (equal masses, perfectly elastic).
+void collide_balls(game_t *game, int i, int j) {
+    float dx = wrapped_delta(game->ball_px[j] - game->ball_px[i]);
+    float dy = game->ball_py[j] - game->ball_py[i];
+    float distance_squared = dx * dx + dy * dy;
+    if (distance_squared >= 4.0f * ball_radius * ball_radius) {
+        return;
+    }
+    float distance = sqrtf(distance_squared);
+    float nx = 1.0f;
+    float ny = 0.0f;
+    if (distance > 0.001f) {
+        nx = dx / distance;
+        ny = dy / distance;
+    }
+    float push = 0.5f * (2.0f * ball_radius - distance);
+    game->ball_px[i] -= push * nx;
+    game->ball_py[i] -= push * ny;
+    game->ball_px[j] += push * nx;
+    game->ball_py[j] += push * ny;
+
+    float approach = (game->ball_vx[j] - game->ball_vx[i]) * nx + (game->ball_vy[j] - game->ball_vy[i]) * ny;
+    if (approach < 0.0f) {
+        game->ball_vx[i] += approach * nx;
+        game->ball_vy[i] += approach * ny;
+        game->ball_vx[j] -= approach * nx;
+        game->ball_vy[j] -= approach * ny;
+    }
+}
+
+// Advance the game by one fixed step of seconds_per_frame.
+void step(game_t *game, uint32_t input) {
+    num_steps++;
+    game->steps++;
+
+    game->left_pressed = input & INPUT_LEFT;
+    game->right_pressed = input & INPUT_RIGHT;
+    game->down_pressed = input & INPUT_DOWN;
+
+    bool reset_keystates = input & INPUT_RESET;
+    if (!game->reset_pressed && reset_keystates) {
+        game->reset_pressed = reset_keystates;
+        init(game);
+        return;
+    } else if (game->reset_pressed && !reset_keystates) {
+        game->reset_pressed = reset_keystates;
+    }
+
+    bool mode_keystates = input & INPUT_MODE;
+    if (!game->mode_pressed && mode_keystates) {
+        game->mode_pressed = mode_keystates;
+        game->game_mode = game->game_mode == GAME_MODE_NORMAL ? GAME_MODE_MULTI_BALL : GAME_MODE_NORMAL;
+        init(game);
+        return;
+    } else if (game->mode_pressed && !mode_keystates) {
+        game->mode_pressed = mode_keystates;
+    }
+
+    bool jump_keystates = input & INPUT_JUMP;
+    if (!game->jump_pressed && jump_keystates) {
+        game->jump_pressed = jump_keystates;
+        game->time_since_jump_press = 0;
+    } else if (game->jump_pressed && !jump_keystates) {
+        game->jump_pressed = jump_keystates;
+        game->time_since_jump_release = 0;
+    }
+
+    if (game->game_over) {
         return;
     }
 
     // Step player
-    last_player_px = player.px;
-    last_player_py = player.py;
-    if (left_pressed ^ right_pressed) {
-        if (left_pressed) {
-            if (player.vx > 0.0f) {
-                player.vx = pivot(player.vx);
+    game->last_player_px = game->player.px;
+    game->last_player_py = game->player.py;
+    if (game->left_pressed ^ game->right_pressed) {
+        if (game->left_pressed) {
+            if (game->player.vx > 0.0f) {
+                game->player.vx = pivot(game->player.vx);
             } else {
-                player.vx = -accelerate(-player.vx);
+                game->player.vx = -accelerate(-game->player.vx);
             }
         } else {
-            if (player.vx < 0.0f) {
-                player.vx = -pivot(-player.vx);
+            if (game->player.vx < 0.0f) {
+                game->player.vx = -pivot(-game->player.vx);
             } else {
-                player.vx = accelerate(player.vx);
+                game->player.vx = accelerate(game->player.vx);
             }
         }
     } else {
-        if (player.vx > 0.0f) {
-            player.vx = decelerate(player.vx);
+        if (game->player.vx > 0.0f) {
+            game->player.vx = decelerate(game->player.vx);
         } else {
-            player.vx = -decelerate(-player.vx);
+            game->player.vx = -decelerate(-game->player.vx);
         }
     }
     // Initiate jump if possible
-    if (time_since_jump_press < time_to_buffer_jump) {
+    if (game->time_since_jump_press < time_to_buffer_jump) {
         // Jump has just been pressed or is buffered
-        if (!player_jumping && (player_on_ground || air_time < coyote_time)) {
+        if (!game->player_jumping && (game->player_on_ground || game->air_time < coyote_time)) {
             // Player is able to jump
-            player.vy = player_jump_velocity;
-            player_jumping = true;
-            Mix_PlayChannel(-1, sfx_jump, 0);
+            game->player.vy = player_jump_velocity;
+            game->player_jumping = true;
+            play_sound(game, SOUND_JUMP);
         }
     }
-    if (jump_time > time_to_max_jump) {
+    if (game->jump_time > time_to_max_jump) {
         // Max jump has been reached
-        player_jumping = false;
+        game->player_jumping = false;
     }
-    if (!player_jumping && down_pressed) {
-        player.vy -= seconds_per_frame * fast_gravity;
+    if (!game->player_jumping && game->down_pressed) {
+        game->player.vy -= seconds_per_frame * fast_gravity;
     } else {
-        player.vy -= seconds_per_frame * gravity;
+        game->player.vy -= seconds_per_frame * gravity;
     }
 
-    player.px += seconds_per_frame * player.vx;
-    player.py += seconds_per_frame * player.vy;
+    game->player.px += seconds_per_frame * game->player.vx;
+    game->player.py += seconds_per_frame * game->player.vy;
 
-    // Step ball
-    last_ball_px = ball.px;
-    last_ball_py = ball.py;
+    // Step balls
+    for (int i = 0; i < game->num_balls; i++) {
+        game->last_ball_py[i] = game->ball_py[i];
 
-    // Squash ball
-    if (player_carrying_ball) {
-        ball.py = player.py + player_height + ball_radius;
-        if (ball_carry_time < time_to_squash) {
-            ball.px = player.px + player_carry_offset;
-            ball_carry_time++;
-        } else {
-            ball.vy = ball_bounce_vy;
-            if (left_pressed ^ right_pressed) {
-                if (left_pressed) {
-                    if (left_pressed_entering_carry_state) {
-                        ball.vx = -ball_bounce_vx;
-                    } else {
-                        ball.vx = -ball_light_bounce_vx;
-                    }
-                } else if (right_pressed) {
-                    if (right_pressed_entering_carry_state) {
-                        ball.vx = ball_bounce_vx;
-                    } else {
-                        ball.vx = ball_light_bounce_vx;
+        // Squash ball
+        if (game->ball_carried[i]) {
+            game->ball_py[i] = game->player.py + player_height + ball_radius;
+            if (game->ball_carry_time[i] < time_to_squash) {
+                game->ball_px[i] = game->player.px + game->ball_carry_offset[i];
+                game->ball_carry_time[i]++;
+            } else {
+                game->ball_vy[i] = ball_bounce_vy;
+                if (game->left_pressed ^ game->right_pressed) {
+                    if (game->left_pressed) {
+                        if (game->ball_carry_input[i] & INPUT_LEFT) {
+                            game->ball_vx[i] = -ball_bounce_vx;
+                        } else {
+                            game->ball_vx[i] = -ball_light_bounce_vx;
+                        }
+                    } else if (game->right_pressed) {
+                        if (game->ball_carry_input[i] & INPUT_RIGHT) {
+                            game->ball_vx[i] = ball_bounce_vx;
+                        } else {
+                            game->ball_vx[i] = ball_light_bounce_vx;
+                        }
                     }
+                } else {
+                    game->ball_vx[i] = 0.0f;
                 }
+                game->ball_carry_input[i] = 0;
+                game->ball_carried[i] = false;
+                game->ball_carry_time[i] = 0;
+                play_sound(game, SOUND_BOUNCE_END);
+            }
+        } else if (game->ball_bouncing[i]) {
+            if (game->ball_bounce_time[i] < time_to_squash) {
+                game->ball_bounce_time[i]++;
             } else {
-                ball.vx = 0.0f;
+                game->ball_vx[i] = game->stored_ball_vx[i];
+                game->ball_vy[i] = game->stored_ball_vy[i];
+                game->ball_py[i] = game->stored_ball_py[i];
+                game->ball_bouncing[i] = false;
+                game->ball_bounce_time[i] = 0;
+                break_brick(game, i);
             }
-            right_pressed_entering_carry_state = false;
-            left_pressed_entering_carry_state = false;
-            player_carrying_ball = false;
-            ball_carry_time = 0;
-            Mix_PlayChannel(-1, sfx_bounce_end, 0);
+        } else {
+            game->ball_vy[i] -= seconds_per_frame * gravity;
+            game->ball_px[i] += seconds_per_frame * game->ball_vx[i];
+            game->ball_py[i] += seconds_per_frame * game->ball_vy[i];
         }
-    } else if (ball_bouncing) {
-        if (ball_bounce_time < time_to_squash) {
-            ball_bounce_time++;
+    }
+
+    // Balls that fall off the bottom of the screen are lost
+    for (int i = 0; i < game->num_balls;) {
+        if (game->ball_py[i] + ball_radius < game->camera_y) {
+            remove_ball(game, i);
         } else {
-            ball.vx = stored_ball_vx;
-            ball.vy = stored_ball_vy;
-            ball.py = stored_ball_py;
-            ball_bouncing = false;
-            ball_bounce_time = 0;
-
-            // Break brick
-            hit_brick->x = 0;
-            hit_brick->y = 0;
-            hit_brick = NULL;
-            Mix_PlayChannel(-1, sfx_brick_break, 0);
-            score++;
-            if (score > high_score) {
-                high_score = score;
-            }
+            i++;
         }
-    } else {
-        ball.vy -= seconds_per_frame * gravity;
-        ball.px += seconds_per_frame * ball.vx;
-        ball.py += seconds_per_frame * ball.vy;        
-    }
-
-    // Check if ball falls off the bottom of screen
-    if (ball.py + ball_radius < camera_y) {
-        game_over = true;
-        Mix_PlayChannel(-1, sfx_game_over, 0);
-    }
-
-    // Check for collision between ball and player
-    if (!player_carrying_ball) {
-        bool collision =
-            check_collision_circle_rect(positive_fmod(ball.px, (float)screen_width), ball.py, ball_radius,
-                                        positive_fmod(player.px, (float)screen_width), player.py, player_width, player_height) ||
-            check_collision_circle_rect(positive_fmod(ball.px, (float)screen_width) - screen_width, ball.py, ball_radius,
-                                        positive_fmod(player.px, (float)screen_width), player.py, player_width, player_height) ||
-            check_collision_circle_rect(positive_fmod(ball.px, (float)screen_width), ball.py, ball_radius,
-                                        positive_fmod(player.px, (float)screen_width) - screen_width, player.py, player_width, player_height);
-        if (collision && last_ball_py > player.py + player_height && ball.vy <= 0.0f) {
-            // Enter carry state
-            player_carry_offset = ball.px - player.px;
-            left_pressed_entering_carry_state = left_pressed;
-            right_pressed_entering_carry_state = right_pressed;
-            player_carrying_ball = true;
-            Mix_PlayChannel(-1, sfx_bounce_start, 0);
-            // Cancel bounce if needed
-            if (ball_bouncing) {
-                ball_bouncing = false;
-                ball_bounce_time = 0;
-
-                // Break brick
-                hit_brick->x = 0;
-                hit_brick->y = 0;
-                hit_brick = NULL;
-                Mix_PlayChannel(-1, sfx_brick_break, 0);
-                score++;
-                if (score > high_score) {
-                    high_score = score;
+    }
+    if (game->num_balls == 0) {
+        game->game_over = true;
+        play_sound(game, SOUND_GAME_OVER);
+        save_ghost(game);
+    }
+
+    build_grids(game);
+
+    // Check for collision between balls and player
+    {
+        int n = query_grid(game->player.px - ball_radius, game->player.px + player_width + ball_radius,
+                           game->player.py - ball_radius, game->player.py + player_height + ball_radius,
+                           ball_cell_start, ball_cell_items);
+        for (int k = 0; k < n; k++) {
+            int i = grid_query_results[k];
+            if (game->ball_carried[i]) {
+                continue;
+            }
+            bool collision = check_collision_ball_rect(game, i, game->player.px, game->player.py, player_width, player_height);
+            if (collision && game->last_ball_py[i] > game->player.py + player_height && game->ball_vy[i] <= 0.0f) {
+                // Enter carry state
+                game->ball_carry_offset[i] = game->ball_px[i] - game->player.px;
+                game->ball_carry_input[i] = input & (INPUT_LEFT | INPUT_RIGHT);
+                game->ball_carried[i] = true;
+                play_sound(game, SOUND_BOUNCE_START);
+                emit_effect(game, EFFECT_SQUASH, game->ball_px[i], game->ball_py[i] - ball_radius);
+                // Cancel bounce if needed
+                if (game->ball_bouncing[i]) {
+                    game->ball_bouncing[i] = false;
+                    game->ball_bounce_time[i] = 0;
+                    break_brick(game, i);
                 }
             }
         }
     }
 
-    // Check for collision between ball and brick or player and brick
-    player_brick = NULL;
-    for (int i = 0; i < MAX_NUM_BRICKS; i++) {
-        brick_t *brick = &bricks[i];
-        if (brick->x == 0 && brick->y == 0) {
-            continue;
-        }        
-        if (brick->y + brick_height < camera_y) {
-            // Off-screen bricks don't have collision
+    // Check for collision between balls and bricks. Where a ball touches
+    // several bricks at once, the lowest numbered one wins.
+    for (int i = 0; i < game->num_balls; i++) {
+        if (game->ball_carried[i] || game->ball_vy[i] >= 0) {
             continue;
         }
-        if (!player_carrying_ball) {
-            bool collision =
-                check_collision_circle_rect(positive_fmod(ball.px, (float)screen_width), ball.py, ball_radius,
-                                            positive_fmod(brick->x, (float)screen_width), brick->y, brick_width, brick_height) ||
-                check_collision_circle_rect(positive_fmod(ball.px, (float)screen_width) - screen_width, ball.py, ball_radius,
-                                            positive_fmod(brick->x, (float)screen_width), brick->y, brick_width, brick_height) ||
-                check_collision_circle_rect(positive_fmod(ball.px, (float)screen_width), ball.py, ball_radius,
-                                            positive_fmod(brick->x, (float)screen_width) - screen_width, brick->y, brick_width, brick_height);
-            if (collision && last_ball_py - ball_radius + 0.001f > brick->y + brick_height && ball.vy < 0) {
-                ball.py = brick->y + brick_height + ball_radius;
-                ball_bouncing = true;
-                stored_ball_vx = ball.vx;
-                stored_ball_vy = -ball_bounce_attenuation * ball.vy;
-                ball.vx = 0.0f;
-                ball.vy = 0.0f;
-                stored_ball_py = ball.py;
-                hit_brick = brick;
-                Mix_PlayChannel(-1, sfx_bounce_start, 0);
+        int n = query_grid(game->ball_px[i] - ball_radius - brick_width, game->ball_px[i] + ball_radius,
+                           game->ball_py[i] - ball_radius - brick_height, game->ball_py[i] + ball_radius,
+                           brick_cell_start, brick_cell_items);
+        int hit = -1;
+        for (int k = 0; k < n; k++) {
+            int b = grid_first_brick + grid_query_results[k];
+            if ((hit >= 0 && b > hit) || is_brick_broken(game, b)) {
+                continue;
+            }
+            bool collision = check_collision_ball_rect(game, i, game->brick_x[b], game->brick_y[b], brick_width, brick_height);
+            if (collision && game->last_ball_py[i] - ball_radius + 0.001f > game->brick_y[b] + brick_height) {
+                hit = b;
             }
         }
-        {
+        if (hit >= 0) {
+            game->ball_py[i] = game->brick_y[hit] + brick_height + ball_radius;
+            game->ball_bouncing[i] = true;
+            game->stored_ball_vx[i] = game->ball_vx[i];
+            game->stored_ball_vy[i] = -ball_bounce_attenuation * game->ball_vy[i];
+            game->ball_vx[i] = 0.0f;
+            game->ball_vy[i] = 0.0f;
+            game->stored_ball_py[i] = game->ball_py[i];
+            game->ball_hit_brick[i] = hit;
+            play_sound(game, SOUND_BOUNCE_START);
+            emit_effect(game, EFFECT_SQUASH, game->ball_px[i], game->ball_py[i] - ball_radius);
+        }
+    }
+
+    // Check for collision between balls
+    if (game->num_balls > 1) {
+        for (int i = 0; i < game->num_balls; i++) {
+            if (game->ball_carried[i] || game->ball_bouncing[i]) {
+                continue;
+            }
+            int n = query_grid(game->ball_px[i] - 2.0f * ball_radius, game->ball_px[i] + 2.0f * ball_radius,
+                               game->ball_py[i] - 2.0f * ball_radius, game->ball_py[i] + 2.0f * ball_radius,
+                               ball_cell_start, ball_cell_items);
+            for (int k = 0; k < n; k++) {
+                int j = grid_query_results[k];
+                if (j <= i || game->ball_carried[j] || game->ball_bouncing[j]) {
+                    continue;
+                }
+                collide_balls(game, i, j);
+            }
+        }
+    }
+
+    // Check for collision between player and bricks
+    bool player_was_on_ground = game->player_on_ground;
+    game->player_brick = -1;
+    if (game->player.vy < 0) {
+        int n = query_grid(game->player.px - brick_width, game->player.px + player_width,
+                           game->player.py - brick_height, game->player.py + player_height,
+                           brick_cell_start, brick_cell_items);
+        for (int k = 0; k < n; k++) {
+            int b = grid_first_brick + grid_query_results[k];
+            if ((game->player_brick >= 0 && b > game->player_brick) || is_brick_broken(game, b)) {
+                continue;
+            }
             bool collision =
-                check_collision_rect_rect(positive_fmod(player.px, (float)screen_width), player.py, player_width, player_height,
-                                          positive_fmod(brick->x, (float)screen_width), brick->y, brick_width, brick_height) ||
-                check_collision_rect_rect(positive_fmod(player.px, (float)screen_width) - screen_width, player.py, player_width, player_height,
-                                          positive_fmod(brick->x, (float)screen_width), brick->y, brick_width, brick_height) ||
-                check_collision_rect_rect(positive_fmod(player.px, (float)screen_width), player.py, player_width, player_height,
-                                          positive_fmod(brick->x, (float)screen_width) - screen_width, brick->y, brick_width, brick_height);
-            if (collision && last_player_py + 0.001f > brick->y + brick_height && player.vy < 0) {
-                camera_focus_y = fmax(camera_focus_y, brick->y);
-                player_brick = brick;
-                player.py = brick->y + brick_height;
-                player.vy = 0.0f;
-                player_on_ground = true;
-                player_jumping = false;
+                check_collision_rect_rect(positive_fmod(game->player.px, (float)screen_width), game->player.py, player_width, player_height,
+                                          positive_fmod(game->brick_x[b], (float)screen_width), game->brick_y[b], brick_width, brick_height) ||
+                check_collision_rect_rect(positive_fmod(game->player.px, (float)screen_width) - screen_width, game->player.py, player_width, player_height,
+                                          positive_fmod(game->brick_x[b], (float)screen_width), game->brick_y[b], brick_width, brick_height) ||
+                check_collision_rect_rect(positive_fmod(game->player.px, (float)screen_width), game->player.py, player_width, player_height,
+                                          positive_fmod(game->brick_x[b], (float)screen_width) - screen_width, game->brick_y[b], brick_width, brick_height);
+            if (collision && game->last_player_py + 0.001f > game->brick_y[b] + brick_height) {
+                game->player_brick = b;
             }
         }
     }
-    if (player_brick == NULL) {
-        player_on_ground = false;
+    if (game->player_brick < 0) {
+        game->player_on_ground = false;
+    } else {
+        game->camera_focus_y = fmax(game->camera_focus_y, game->brick_y[game->player_brick]);
+        game->player.py = game->brick_y[game->player_brick] + brick_height;
+        game->player.vy = 0.0f;
+        game->player_on_ground = true;
+        game->player_jumping = false;
+        if (!player_was_on_ground) {
+            emit_effect(game, EFFECT_LANDING, game->player.px + player_width * 0.5f, game->player.py);
+        }
     }
 
     // Move camera
-    float camera_target_y = camera_focus_y - camera_focus_bottom_margin;
-    if (fabs(camera_y - camera_target_y) > 0.001f) {
-        camera_y = (1.0f - camera_move_factor) * camera_y + camera_move_factor * camera_target_y;
+    float camera_target_y = game->camera_focus_y - camera_focus_bottom_margin;
+    if (fabs(game->camera_y - camera_target_y) > 0.001f) {
+        game->camera_y = (1.0f - camera_move_factor) * game->camera_y + camera_move_factor * camera_target_y;
     }
 
     // Increment counters
-    if (!player_on_ground) {
-        air_time++;
-        if (player_jumping) {
-            jump_time++;
+    if (!game->player_on_ground) {
+        game->air_time++;
+        if (game->player_jumping) {
+            game->jump_time++;
         }
     } else {
-        air_time = 0;
-        jump_time = 0;
+        game->air_time = 0;
+        game->jump_time = 0;
     }
-    if (time_since_jump_press < max_time) {
-        time_since_jump_press++;
+    if (game->time_since_jump_press < max_time) {
+        game->time_since_jump_press++;
     }
-    if (time_since_jump_release < max_time - 1) {
-        time_since_jump_release++;
+    if (game->time_since_jump_release < max_time - 1) {
+        game->time_since_jump_release++;
     }
 
-    // Render
-    SDL_RenderClear(renderer);
-    if (!game_over) {
-        for (int i = 0; i < MAX_NUM_BRICKS; i++) {
-            brick_t *brick = &bricks[i];
-            if (brick->x == 0 && brick->y == 0) {
-                continue;
-            }
-            SDL_Rect dst_rect = {.x = (int)brick->x, .y = screen_height - (int)(brick->y + brick_height - camera_y), .w = (int)brick_width, .h = (int)brick_height};
-            dst_rect.x = positive_fmod(dst_rect.x, screen_width);
-            SDL_Rect wrap_rect = dst_rect;
-            wrap_rect.x -= screen_width;
-            SDL_RenderCopy(renderer, brick_texture, NULL, &dst_rect);
-            SDL_RenderCopy(renderer, brick_texture, NULL, &wrap_rect);
+    update_ghost(game);
+}
+
+// Queue a message for the ghost file I/O, tagged with the current run.
+// Returns false if the queue is full.
+bool queue_ghost_message(game_t *game, ghost_message_kind_t kind, uint32_t value, const uint8_t *bytes, int size) {
+    int slot = spsc_reserve(&game->ghost_messages, GHOST_QUEUE_SIZE);
+    if (slot < 0) {
+        return false;
+    }
+    ghost_message_t *message = &game->ghost_queue[slot];
+    message->kind = kind;
+    message->run = game->ghost_run;
+    message->value = value;
+    message->size = size;
+    if (size > 0) {
+        memcpy(message->bytes, bytes, size);
+    }
+    spsc_commit(&game->ghost_messages);
+    return true;
+}
+
+int encode_ghost_delta(uint8_t *bytes, int32_t from, int32_t to) {
+    uint32_t delta = (uint32_t)to - (uint32_t)from;
+    uint32_t v = (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+    int size = 0;
+    while (v >= 0x80) {
+        bytes[size++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    bytes[size++] = v;
+    return size;
+}
+
+// Start recording a new run and look for the saved ghost's steps for it.
+void start_ghost(game_t *game) {
+    if (!game->has_ghost) {
+        return;
+    }
+    game->ghost_run++;
+    game->ghost_step = 0;
+    game->ghost_visible = false;
+    game->ghost_out_frame = (ghost_frame_t){0};
+    game->ghost_recording = queue_ghost_message(game, GHOST_START, game->game_mode, NULL, 0);
+}
+
+// Record this step of the current run and pick up the ghost's.
+void update_ghost(game_t *game) {
+    if (!game->has_ghost) {
+        return;
+    }
+    if (game->ghost_recording) {
+        ghost_frame_t frame = game->ghost_out_frame;
+        frame.flags = (game->num_balls > 0 ? GHOST_BALL : 0) |
+                      (game->player_on_ground || game->air_time < coyote_time ? GHOST_GROUNDED : 0) |
+                      (game->player_jumping ? GHOST_JUMPING : 0);
+        frame.player_x = lroundf(game->player.px);
+        frame.player_y = lroundf(game->player.py);
+        if (game->num_balls > 0) {
+            frame.ball_x = lroundf(game->ball_px[0]);
+            frame.ball_y = lroundf(game->ball_py[0]);
         }
-        {
-            SDL_Rect dst_rect = {.x = (int)(ball.px - ball_radius), .y = screen_height - (int)(ball.py + ball_radius - camera_y), .w = (int)(ball_radius * 2), .h = (int)(ball_radius * 2)};
-            if (player_carrying_ball || ball_bouncing) {
-                const int ball_squash_width = 2.0f * ball_radius + 4.0f * 4.0f;
-                float x = ball.px - (float)ball_squash_width / 2.0f;
-                dst_rect.w = ball_squash_width;
-                dst_rect.x = x;
-            }
-            dst_rect.x = positive_fmod(dst_rect.x, screen_width);
-            SDL_Rect wrap_rect = dst_rect;
-            wrap_rect.x -= screen_width;
-            if (player_carrying_ball || ball_bouncing) {
-                SDL_RenderCopy(renderer, ball_squash_texture, NULL, &dst_rect);
-                SDL_RenderCopy(renderer, ball_squash_texture, NULL, &wrap_rect);
-            } else {
-                SDL_RenderCopy(renderer, ball_texture, NULL, &dst_rect);
-                SDL_RenderCopy(renderer, ball_texture, NULL, &wrap_rect);
-            }
+        uint8_t bytes[GHOST_MAX_STEP_SIZE];
+        int size = 0;
+        bytes[size++] = frame.flags;
+        size += encode_ghost_delta(&bytes[size], game->ghost_out_frame.player_x, frame.player_x);
+        size += encode_ghost_delta(&bytes[size], game->ghost_out_frame.player_y, frame.player_y);
+        size += encode_ghost_delta(&bytes[size], game->ghost_out_frame.ball_x, frame.ball_x);
+        size += encode_ghost_delta(&bytes[size], game->ghost_out_frame.ball_y, frame.ball_y);
+        // A missing step would throw off every one after it, so the run is
+        // given up on instead
+        game->ghost_recording = queue_ghost_message(game, GHOST_STEP, 0, bytes, size);
+        game->ghost_out_frame = frame;
+    }
+
+    // Steps from an earlier run are stale. One that hasn't been read yet
+    // isn't waited for, the ghost is just hidden for that step.
+    game->ghost_visible = false;
+    int slot;
+    while ((slot = spsc_peek(&game->ghost_steps, GHOST_STEP_QUEUE_SIZE)) >= 0) {
+        const ghost_step_t *step = &game->ghost_step_queue[slot];
+        if (step->run == game->ghost_run && step->step > game->ghost_step) {
+            break;
         }
-        {
-            SDL_Rect dst_rect = {.x = (int)player.px, .y = screen_height - (int)(player.py + player_height - camera_y), .w = (int)player_width, .h = (int)player_height};
-            dst_rect.x = positive_fmod(dst_rect.x, screen_width);
+        if (step->run == game->ghost_run && step->step == game->ghost_step) {
+            game->ghost_frame = step->frame;
+            game->ghost_visible = true;
+        }
+        spsc_release(&game->ghost_steps);
+        if (game->ghost_visible) {
+            break;
+        }
+    }
+    game->ghost_step++;
+}
+
+// Finish recording. Whether the run beats the saved ghost is decided when the
+// message is handled.
+void save_ghost(game_t *game) {
+    if (!game->ghost_recording) {
+        return;
+    }
+    game->ghost_recording = false;
+    queue_ghost_message(game, GHOST_SAVE, game->score, NULL, 0);
+}
+
+void write_ghost_header(game_mode_t mode, uint32_t score) {
+    uint8_t header[GHOST_HEADER_SIZE] = {'U', 'B', 'G', 'H', GHOST_VERSION, mode, 0, 0, score, score >> 8, score >> 16, score >> 24};
+    fwrite(header, 1, sizeof(header), ghost_out);
+}
+
+bool read_ghost_delta(int32_t *value) {
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = getc(ghost_in);
+        if (c == EOF) {
+            return false;
+        }
+        v |= (uint32_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *value += (int32_t)((v >> 1) ^ -(v & 1));
+            return true;
+        }
+    }
+    return false;
+}
+
+// Where the best run for a mode on the current level is saved. A run is only
+// ever raced against, and only replaces, one on the same bricks.
+void ghost_path(game_mode_t mode, char *path, size_t size) {
+    if (level_stage == NULL) {
+        snprintf(path, size, "%s%s.bin", pref_path, ghost_file_names[mode]);
+    } else {
+        snprintf(path, size, "%s%s_%08x.bin", pref_path, ghost_file_names[mode], level_stage_hash);
+    }
+}
+
+// Open the temporary file for a new run and rewind the saved ghost for its
+// mode.
+void open_ghost_files(game_mode_t mode, uint32_t run) {
+    char path[1024];
+
+    if (ghost_out != NULL) {
+        // Abandoned run
+        fclose(ghost_out);
+    }
+    snprintf(path, sizeof(path), "%s%s", pref_path, ghost_temp_file_name);
+    ghost_out = fopen(path, "wb");
+    if (ghost_out != NULL) {
+        setvbuf(ghost_out, ghost_out_buffer, _IOFBF, GHOST_BUFFER_SIZE);
+        write_ghost_header(mode, 0);
+        ghost_out_mode = mode;
+    }
+
+    ghost_reading = false;
+    ghost_in_score = 0;
+    if (ghost_in != NULL && ghost_in_mode != mode) {
+        fclose(ghost_in);
+        ghost_in = NULL;
+    }
+    if (ghost_in == NULL) {
+        ghost_path(mode, path, sizeof(path));
+        ghost_in = fopen(path, "rb");
+        if (ghost_in == NULL) {
+            return;
+        }
+        setvbuf(ghost_in, ghost_in_buffer, _IOFBF, GHOST_BUFFER_SIZE);
+        ghost_in_mode = mode;
+    }
+
+    uint8_t header[GHOST_HEADER_SIZE];
+    rewind(ghost_in);
+    if (fread(header, 1, sizeof(header), ghost_in) != sizeof(header) || memcmp(header, "UBGH", 4) != 0 ||
+        header[4] != GHOST_VERSION || header[5] != mode) {
+        fclose(ghost_in);
+        ghost_in = NULL;
+        return;
+    }
+    ghost_in_score = header[8] | header[9] << 8 | header[10] << 16 | (uint32_t)header[11] << 24;
+    ghost_in_frame = (ghost_frame_t){0};
+    ghost_in_run = run;
+    ghost_in_step = 0;
+    ghost_reading = true;
+}
+
+// Close the finished run, keeping it as the new ghost if it beat the old one.
+void close_ghost_files(uint32_t score) {
+    if (ghost_out == NULL) {
+        return;
+    }
+    bool best = score > ghost_in_score;
+    if (best) {
+        fseek(ghost_out, 0, SEEK_SET);
+        write_ghost_header(ghost_out_mode, score);
+    }
+    bool written = fclose(ghost_out) == 0;
+    ghost_out = NULL;
+
+    char temp_path[1024];
+    snprintf(temp_path, sizeof(temp_path), "%s%s", pref_path, ghost_temp_file_name);
+    if (!best || !written) {
+        remove(temp_path);
+        return;
+    }
+    if (ghost_in != NULL) {
+        fclose(ghost_in);
+        ghost_in = NULL;
+        ghost_reading = false;
+    }
+    char path[1024];
+    ghost_path(ghost_out_mode, path, sizeof(path));
+    // rename() won't replace an existing file on Windows
+    remove(path);
+    rename(temp_path, path);
+}
+
+// Do the file I/O the simulation queued for the ghost, then read the saved
+// ghost ahead of it as far as the step queue allows.
+void update_ghost_files(game_t *game) {
+    if (!game->has_ghost) {
+        return;
+    }
+    int slot;
+    while ((slot = spsc_peek(&game->ghost_messages, GHOST_QUEUE_SIZE)) >= 0) {
+        const ghost_message_t *message = &game->ghost_queue[slot];
+        switch (message->kind) {
+        case GHOST_START:
+            open_ghost_files(message->value, message->run);
+            break;
+        case GHOST_STEP:
+            if (ghost_out != NULL) {
+                fwrite(message->bytes, 1, message->size, ghost_out);
+            }
+            break;
+        case GHOST_SAVE:
+            close_ghost_files(message->value);
+            break;
+        }
+        spsc_release(&game->ghost_messages);
+    }
+
+    while (ghost_reading && (slot = spsc_reserve(&game->ghost_steps, GHOST_STEP_QUEUE_SIZE)) >= 0) {
+        int flags = getc(ghost_in);
+        ghost_in_frame.flags = flags;
+        // The ghost disappears when its run ends
+        ghost_reading = flags != EOF &&
+                        read_ghost_delta(&ghost_in_frame.player_x) && read_ghost_delta(&ghost_in_frame.player_y) &&
+                        read_ghost_delta(&ghost_in_frame.ball_x) && read_ghost_delta(&ghost_in_frame.ball_y);
+        if (ghost_reading) {
+            game->ghost_step_queue[slot] = (ghost_step_t){.run = ghost_in_run, .step = ghost_in_step++, .frame = ghost_in_frame};
+            spsc_commit(&game->ghost_steps);
+        }
+    }
+}
+
+// Open the next queued replay and return its game mode, or -1 once they've
+// all been played.
+int open_next_session(game_t *game) {
+    for (int tries = 0; tries < num_replays && (loop_replays || game->num_replays_played < num_replays); tries++) {
+        const char *path = replay_paths[game->next_replay];
+        game->next_replay = (game->next_replay + 1) % num_replays;
+        game->num_replays_played++;
+        FILE *file = fopen(path, "rb");
+        uint8_t header[SESSION_HEADER_SIZE];
+        if (file == NULL || fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, "UBRS", 4) != 0 ||
+            header[4] != SESSION_VERSION || header[5] >= NUM_GAME_MODES) {
+            fprintf(stderr, "Can't replay %s\n", path);
+            replay_failed = true;
+            if (file != NULL) {
+                fclose(file);
+            }
+            continue;
+        }
+        game->session_in = file;
+        return header[5];
+    }
+    return -1;
+}
+
+// Read the seed record that follows a step or the header, if there is one.
+bool read_session_seed(FILE *file, uint32_t *seed) {
+    int c = getc(file);
+    if (c != SESSION_SEED) {
+        if (c != EOF) {
+            ungetc(c, file);
+        }
+        return false;
+    }
+    uint8_t bytes[4];
+    if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes)) {
+        return false;
+    }
+    *seed = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+    return true;
+}
+
+// Write out what the simulation recorded, then read the replays ahead of it
+// as far as the entry queue allows.
+void update_session_files(game_t *game) {
+    int slot;
+    while ((slot = spsc_peek(&game->session_bytes, SESSION_BYTE_QUEUE_SIZE)) >= 0) {
+        putc(game->session_byte_queue[slot], game->session_out);
+        spsc_release(&game->session_bytes);
+    }
+
+    while (game->reading_replays && (slot = spsc_reserve(&game->replay_entries, REPLAY_QUEUE_SIZE)) >= 0) {
+        replay_entry_t *entry = &game->replay_queue[slot];
+        if (game->session_in == NULL) {
+            int mode = open_next_session(game);
+            if (mode < 0) {
+                *entry = (replay_entry_t){.kind = REPLAY_DONE};
+                game->reading_replays = false;
+            } else {
+                *entry = (replay_entry_t){.kind = REPLAY_NEXT, .value = mode};
+                entry->has_seed = read_session_seed(game->session_in, &entry->seed);
+            }
+        } else {
+            int c = getc(game->session_in);
+            if (c == EOF) {
+                fclose(game->session_in);
+                game->session_in = NULL;
+                continue;
+            }
+            *entry = (replay_entry_t){.kind = REPLAY_STEP, .value = c};
+            entry->has_seed = read_session_seed(game->session_in, &entry->seed);
+        }
+        spsc_commit(&game->replay_entries);
+    }
+}
+
+// Take the replay start or end at the head of the entries. Returns false
+// once they've all been played, when the game goes back to the keyboard.
+bool start_next_session(game_t *game) {
+    int slot = spsc_peek(&game->replay_entries, REPLAY_QUEUE_SIZE);
+    replay_entry_t entry = game->replay_queue[slot];
+    spsc_release(&game->replay_entries);
+    game->replay_skipping = false;
+    game->has_replay_seed = entry.has_seed;
+    game->replay_seed = entry.seed;
+    if (entry.kind == REPLAY_DONE) {
+        game->replaying = false;
+        return false;
+    }
+    game->game_mode = entry.value;
+    return true;
+}
+
+// A replay ran out: start the next one, or go back to the keyboard after the
+// last. Headless runs quit once every game is done.
+void end_session(game_t *game) {
+    if (start_next_session(game)) {
+        init(game);
+    } else if (headless && --num_games_playing == 0) {
+        SDL_AtomicSet(&should_quit, 1);
+    }
+}
+
+void start_recording(game_t *game, const char *path) {
+    game->session_out = fopen(path, "wb");
+    if (game->session_out == NULL) {
+        fprintf(stderr, "Can't record to %s\n", path);
+        return;
+    }
+    uint8_t header[SESSION_HEADER_SIZE] = {'U', 'B', 'R', 'S', SESSION_VERSION, game->game_mode, 0, 0};
+    fwrite(header, 1, sizeof(header), game->session_out);
+    game->recording = true;
+}
+
+// Queue recorded bytes for update_session_files. A recording the main thread
+// falls that far behind on is cut short.
+void record_session_bytes(game_t *game, const uint8_t *bytes, int size) {
+    for (int i = 0; i < size; i++) {
+        int slot = spsc_reserve(&game->session_bytes, SESSION_BYTE_QUEUE_SIZE);
+        if (slot < 0) {
+            game->recording = false;
+            game->recording_dropped = true;
+            return;
+        }
+        game->session_byte_queue[slot] = bytes[i];
+        spsc_commit(&game->session_bytes);
+    }
+}
+
+// Swap in the replayed input for this step, or record the live one.
+session_status_t session_input(game_t *game, uint32_t *input) {
+    if (!game->replaying) {
+        if (game->recording) {
+            uint8_t byte = *input;
+            record_session_bytes(game, &byte, 1);
+        }
+        return SESSION_READY;
+    }
+    int slot;
+    while ((slot = spsc_peek(&game->replay_entries, REPLAY_QUEUE_SIZE)) >= 0) {
+        const replay_entry_t *entry = &game->replay_queue[slot];
+        if (entry->kind != REPLAY_STEP) {
+            // Left for end_session
+            return SESSION_OVER;
+        }
+        if (!game->replay_skipping && ((entry->value & SESSION_SEED) || game->has_replay_seed)) {
+            // A seed where the last step didn't init()
+            fprintf(stderr, "Replay out of sync\n");
+            replay_failed = true;
+            game->replay_skipping = true;
+        }
+        if (game->replay_skipping) {
+            spsc_release(&game->replay_entries);
+            continue;
+        }
+        *input = entry->value;
+        game->has_replay_seed = entry->has_seed;
+        game->replay_seed = entry->seed;
+        spsc_release(&game->replay_entries);
+        return SESSION_READY;
+    }
+    return SESSION_WAIT;
+}
+
+// The seed for init(), taken from the replay or recorded.
+uint32_t session_seed(game_t *game, uint32_t seed) {
+    if (game->replaying) {
+        if (game->has_replay_seed) {
+            game->has_replay_seed = false;
+            return game->replay_seed;
+        }
+        fprintf(stderr, "Replay out of sync\n");
+        replay_failed = true;
+        // End it at the next step
+        game->replay_skipping = true;
+    } else if (game->recording) {
+        uint8_t bytes[5] = {SESSION_SEED, seed, seed >> 8, seed >> 16, seed >> 24};
+        record_session_bytes(game, bytes, sizeof(bytes));
+    }
+    return seed;
+}
+
+// Copy what the renderer needs out of the simulation state into the slot the
+// simulation owns, then swap it into the shared slot of the triple buffer.
+void publish_render_state(game_t *game) {
+    render_state_t *state = &game->render_states[game->render_state_write];
+
+    state->player = game->player;
+    state->camera_y = game->camera_y;
+    state->ghost_visible = game->ghost_visible;
+    state->ghost = game->ghost_frame;
+    state->player_grounded = game->player_on_ground || game->air_time < coyote_time;
+    state->player_jumping = game->player_jumping;
+    state->game_over = game->game_over;
+    state->step = game->steps;
+    state->score = game->score;
+    state->high_score = game->high_scores[game->game_mode];
+
+    // Off-screen bricks aren't drawn
+    state->num_bricks = 0;
+    for (int i = find_brick(game, game->camera_y - brick_height); i < game->num_bricks && game->brick_y[i] <= game->camera_y + screen_height; i++) {
+        if (is_brick_broken(game, i)) {
+            continue;
+        }
+        if (state->num_bricks == MAX_VISIBLE_BRICKS) {
+            break;
+        }
+        state->bricks[state->num_bricks++] = (brick_t){.x = game->brick_x[i], .y = game->brick_y[i], .type = game->brick_type[i]};
+    }
+
+    state->num_balls = 0;
+    for (int i = 0; i < game->num_balls; i++) {
+        if (game->ball_py[i] - ball_radius > game->camera_y + screen_height) {
+            continue;
+        }
+        int j = state->num_balls++;
+        state->ball_px[j] = game->ball_px[i];
+        state->ball_py[j] = game->ball_py[i];
+        state->ball_squashed[j] = game->ball_carried[i] || game->ball_bouncing[i];
+    }
+
+    SDL_MemoryBarrierRelease();
+    game->render_state_write = SDL_AtomicSet(&game->render_state_shared, game->render_state_write | RENDER_STATE_FRESH) & ~RENDER_STATE_FRESH;
+}
+
+// Take the most recently published render state. If nothing new has been
+// published since the last call, the previous state is returned again.
+const render_state_t *acquire_render_state(view_t *view) {
+    game_t *g = view->game;
+    if (SDL_AtomicGet(&g->render_state_shared) & RENDER_STATE_FRESH) {
+        view->render_state_read = SDL_AtomicSet(&g->render_state_shared, view->render_state_read) & ~RENDER_STATE_FRESH;
+        SDL_MemoryBarrierAcquire();
+    }
+    return &g->render_states[view->render_state_read];
+}
+
+// Request a visual effect from the simulation. Dropped if the renderer has
+// fallen behind and the queue is full.
+void emit_effect(game_t *game, effect_kind_t kind, float x, float y) {
+    int slot = spsc_reserve(&game->effects, EFFECT_QUEUE_SIZE);
+    if (slot < 0) {
+        return;
+    }
+    game->effect_queue[slot] = (effect_t){.kind = kind, .x = x, .y = y};
+    spsc_commit(&game->effects);
+}
+
+// Each view has its own generator, so the renderer never touches the
+// game's.
+float particle_rand_range(view_t *view, float min, float max) {
+    return xorshift_range(&view->particle_rng, min, max);
+}
+
+void spawn_particle(view_t *view, float x, float y, float vx, float vy, float gravity, float drag, float life) {
+    if (view->num_particles == MAX_NUM_PARTICLES) {
+        return;
+    }
+    int i = view->num_particles++;
+    view->particle_px[i] = positive_fmod(x, screen_width);
+    view->particle_py[i] = y;
+    view->particle_vx[i] = vx;
+    view->particle_vy[i] = vy;
+    view->particle_gravity[i] = gravity;
+    view->particle_drag[i] = drag;
+    view->particle_life[i] = life;
+}
+
+void spawn_dust(view_t *view, float x, float y, float direction) {
+    spawn_particle(view, x, y,
+                   direction * particle_rand_range(view, 0.3f, 1.0f) * particle_dust_speed,
+                   particle_rand_range(view, 0.0f, 0.4f) * particle_dust_speed,
+                   0.0f, particle_dust_drag, particle_rand_range(view, 0.2f, 0.4f));
+}
+
+void spawn_effect(view_t *view, const effect_t *effect) {
+    if (effect->kind == EFFECT_CLEAR) {
+        view->num_particles = 0;
+    } else if (effect->kind == EFFECT_BRICK_BREAK) {
+        for (int i = 0; i < 24; i++) {
+            spawn_particle(view, effect->x + particle_rand_range(view, 0.0f, brick_width),
+                           effect->y + particle_rand_range(view, 0.0f, brick_height),
+                           particle_rand_range(view, -1.0f, 1.0f) * particle_debris_speed,
+                           particle_rand_range(view, 0.2f, 1.0f) * particle_debris_speed,
+                           gravity, 0.0f, particle_rand_range(view, 0.4f, 0.9f));
+        }
+        for (int i = 0; i < 8; i++) {
+            spawn_dust(view, effect->x + particle_rand_range(view, 0.0f, brick_width), effect->y + brick_height, i % 2 ? 1.0f : -1.0f);
+        }
+    } else if (effect->kind == EFFECT_SQUASH) {
+        for (int i = 0; i < 6; i++) {
+            spawn_dust(view, effect->x, effect->y, i % 2 ? 1.0f : -1.0f);
+        }
+    } else if (effect->kind == EFFECT_LANDING) {
+        for (int i = 0; i < 4; i++) {
+            spawn_dust(view, effect->x - player_width * 0.5f, effect->y, -1.0f);
+            spawn_dust(view, effect->x + player_width * 0.5f, effect->y, 1.0f);
+        }
+    }
+}
+
+void update_particles(view_t *view, float dt) {
+    float *restrict px = view->particle_px;
+    float *restrict py = view->particle_py;
+    float *restrict vx = view->particle_vx;
+    float *restrict vy = view->particle_vy;
+    float *restrict g = view->particle_gravity;
+    float *restrict drag = view->particle_drag;
+    float *restrict life = view->particle_life;
+    const float width = screen_width;
+    int n = view->num_particles;
+
+    // No branches in here, so it vectorizes
+    for (int i = 0; i < n; i++) {
+        vx[i] -= vx[i] * drag[i] * dt;
+        vy[i] -= vy[i] * drag[i] * dt + g[i] * dt;
+        float x = px[i] + vx[i] * dt;
+        float wrap = (float)(x < 0.0f) - (float)(x >= width);
+        px[i] = x + wrap * width;
+        py[i] += vy[i] * dt;
+        life[i] -= dt;
+    }
+
+    // Swap dead particles with the last live one to keep the pool packed
+    for (int i = 0; i < n;) {
+        if (life[i] > 0.0f) {
+            i++;
+            continue;
+        }
+        n--;
+        px[i] = px[n];
+        py[i] = py[n];
+        vx[i] = vx[n];
+        vy[i] = vy[n];
+        g[i] = g[n];
+        drag[i] = drag[n];
+        life[i] = life[n];
+    }
+    view->num_particles = n;
+}
+
+// Round a screen coordinate to the first logical pixel whose center is at or
+// past it.
+int capture_coord(int pixel) {
+    int offset = pixel - (int)scale / 2;
+    return offset >= 0 ? (offset + (int)scale - 1) / (int)scale : -(-offset / (int)scale);
+}
+
+// Draw a mask, or a solid rect if mask is NULL, into the frame being captured
+// with the same placement and nearest-neighbor scaling as the screen.
+void capture_rect(const SDL_Rect *rect, const mask_t *mask) {
+    if (rect->w <= 0 || rect->h <= 0 || (mask != NULL && mask->bits == NULL)) {
+        return;
+    }
+    int x0 = SDL_max(capture_coord(rect->x), 0);
+    int x1 = SDL_min(capture_coord(rect->x + rect->w), CAPTURE_WIDTH);
+    int y0 = SDL_max(capture_coord(rect->y), 0);
+    int y1 = SDL_min(capture_coord(rect->y + rect->h), CAPTURE_HEIGHT);
+    for (int y = y0; y < y1; y++) {
+        uint8_t *row = &capture_pixels[y * CAPTURE_WIDTH];
+        if (mask == NULL) {
+            if (x1 > x0) {
+                memset(&row[x0], 1, x1 - x0);
+            }
+            continue;
+        }
+        int my = (y * (int)scale + (int)scale / 2 - rect->y) * mask->h / rect->h;
+        const uint8_t *bits = &mask->bits[my * mask->w];
+        for (int x = x0; x < x1; x++) {
+            int mx = (x * (int)scale + (int)scale / 2 - rect->x) * mask->w / rect->w;
+            row[x] |= bits[mx];
+        }
+    }
+}
+
+void draw_texture(SDL_Texture *texture, const mask_t *mask, const SDL_Rect *rect) {
+    SDL_RenderCopy(renderer, texture, NULL, rect);
+    if (capture_pixels != NULL) {
+        capture_rect(rect, mask);
+    }
+}
+
+// Fill rects in the sprite color with a single batched call.
+void fill_rects(const SDL_Rect *rects, int num_rects) {
+    SDL_SetRenderDrawColor(renderer, sprite_color.r, sprite_color.g, sprite_color.b, sprite_color.a);
+    SDL_RenderFillRects(renderer, rects, num_rects);
+    SDL_SetRenderDrawColor(renderer, bg_color.r, bg_color.g, bg_color.b, bg_color.a);
+    if (capture_pixels != NULL) {
+        for (int i = 0; i < num_rects; i++) {
+            capture_rect(&rects[i], NULL);
+        }
+    }
+}
+
+// Start capturing the frame render() is about to draw if it shows a step
+// that hasn't been captured yet.
+void begin_capture_frame(uint32_t step) {
+    if (capture_worker == NULL || step == last_capture_step) {
+        return;
+    }
+    int slot;
+    while ((slot = spsc_reserve(&captures, CAPTURE_QUEUE_SIZE)) < 0) {
+        if (!headless) {
+            captures_dropped++;
+            return;
+        }
+        // Nothing to keep up with, so wait for the encoder instead
+        SDL_Delay(1);
+    }
+    last_capture_step = step;
+    capture_queue[slot].step = step;
+    capture_pixels = capture_queue[slot].pixels;
+    memset(capture_pixels, 0, sizeof(capture_queue[slot].pixels));
+}
+
+void end_capture_frame() {
+    if (capture_pixels == NULL) {
+        return;
+    }
+    capture_pixels = NULL;
+    spsc_commit(&captures);
+    SDL_SemPost(capture_ready);
+}
+
+// Draw all particles with a single batched fill call.
+void draw_particles(view_t *view, float camera_y) {
+    const int size = (int)particle_size;
+    int num_rects = 0;
+    for (int i = 0; i < view->num_particles; i++) {
+        SDL_Rect rect = {.x = (int)view->particle_px[i], .y = screen_height - (int)(view->particle_py[i] + particle_size - camera_y), .w = size, .h = size};
+        if (rect.y + size < 0 || rect.y > (int)screen_height) {
+            continue;
+        }
+        particle_rects[num_rects++] = rect;
+        if (rect.x + size > (int)screen_width) {
+            rect.x -= screen_width;
+            particle_rects[num_rects++] = rect;
+        }
+    }
+    if (num_rects == 0) {
+        return;
+    }
+    fill_rects(particle_rects, num_rects);
+}
+
+// Draw the best run translucently behind the live player and ball.
+void draw_ghost(const ghost_frame_t *ghost, float camera_y) {
+    SDL_Texture *texture = ghost->flags & GHOST_GROUNDED ? player_texture : ghost->flags & GHOST_JUMPING ? player_jump_texture : player_fall_texture;
+    SDL_Rect dst_rect = {.x = ghost->player_x, .y = screen_height - (int)(ghost->player_y + player_height - camera_y), .w = (int)player_width, .h = (int)player_height};
+    dst_rect.x = positive_fmod(dst_rect.x, screen_width);
+    SDL_Rect wrap_rect = dst_rect;
+    wrap_rect.x -= screen_width;
+    SDL_SetTextureAlphaMod(texture, ghost_alpha);
+    SDL_RenderCopy(renderer, texture, NULL, &dst_rect);
+    SDL_RenderCopy(renderer, texture, NULL, &wrap_rect);
+    SDL_SetTextureAlphaMod(texture, 0xFF);
+
+    if (ghost->flags & GHOST_BALL) {
+        dst_rect = (SDL_Rect){.x = (int)(ghost->ball_x - ball_radius), .y = screen_height - (int)(ghost->ball_y + ball_radius - camera_y), .w = (int)(ball_radius * 2), .h = (int)(ball_radius * 2)};
+        dst_rect.x = positive_fmod(dst_rect.x, screen_width);
+        wrap_rect = dst_rect;
+        wrap_rect.x -= screen_width;
+        SDL_SetTextureAlphaMod(ball_texture, ghost_alpha);
+        SDL_RenderCopy(renderer, ball_texture, NULL, &dst_rect);
+        SDL_RenderCopy(renderer, ball_texture, NULL, &wrap_rect);
+        SDL_SetTextureAlphaMod(ball_texture, 0xFF);
+    }
+}
+
+// Draw the game of a view into its viewport.
+void render_game(view_t *view, const render_state_t *state) {
+    float camera_y = state->camera_y;
+
+    spsc_queue_t *effects = &view->game->effects;
+    int slot;
+    while ((slot = spsc_peek(effects, EFFECT_QUEUE_SIZE)) >= 0) {
+        spawn_effect(view, &view->game->effect_queue[slot]);
+        spsc_release(effects);
+    }
+    // Particles move by simulation steps, not wall-clock time, so they look
+    // the same in a headless capture as in live play
+    uint32_t steps = state->step - view->last_particle_step;
+    if (steps > 0) {
+        update_particles(view, fmin(steps * seconds_per_frame, max_particle_step));
+    }
+    view->last_particle_step = state->step;
+
+    // Only the first game is captured. The ghost isn't part of the game, so
+    // it's drawn straight to the screen and left out of captures.
+    if (view == &views[0]) {
+        begin_capture_frame(state->step);
+    }
+    SDL_RenderSetViewport(renderer, &view->viewport);
+    if (!state->game_over) {
+        int num_solid_brick_rects = 0;
+        for (int i = 0; i < state->num_bricks; i++) {
+            const brick_t *brick = &state->bricks[i];
+            SDL_Rect dst_rect = {.x = (int)brick->x, .y = screen_height - (int)(brick->y + brick_height - camera_y), .w = (int)brick_width, .h = (int)brick_height};
+            dst_rect.x = positive_fmod(dst_rect.x, screen_width);
             SDL_Rect wrap_rect = dst_rect;
             wrap_rect.x -= screen_width;
-            if (player_on_ground || air_time < coyote_time) {
-                SDL_RenderCopy(renderer, player_texture, NULL, &dst_rect);
-                SDL_RenderCopy(renderer, player_texture, NULL, &wrap_rect);
+            if (brick->type == BRICK_SOLID) {
+                // Solid bricks are filled in, batched up and drawn together
+                solid_brick_rects[num_solid_brick_rects++] = dst_rect;
+                solid_brick_rects[num_solid_brick_rects++] = wrap_rect;
+                continue;
+            }
+            draw_texture(brick_texture, &brick_mask, &dst_rect);
+            draw_texture(brick_texture, &brick_mask, &wrap_rect);
+        }
+        if (num_solid_brick_rects > 0) {
+            fill_rects(solid_brick_rects, num_solid_brick_rects);
+        }
+        draw_particles(view, camera_y);
+        if (state->ghost_visible) {
+            draw_ghost(&state->ghost, camera_y);
+        }
+        for (int i = 0; i < state->num_balls; i++) {
+            SDL_Rect dst_rect = {.x = (int)(state->ball_px[i] - ball_radius), .y = screen_height - (int)(state->ball_py[i] + ball_radius - camera_y), .w = (int)(ball_radius * 2), .h = (int)(ball_radius * 2)};
+            if (state->ball_squashed[i]) {
+                const int ball_squash_width = 2.0f * ball_radius + 4.0f * 4.0f;
+                float x = state->ball_px[i] - (float)ball_squash_width / 2.0f;
+                dst_rect.w = ball_squash_width;
+                dst_rect.x = x;
+            }
+            dst_rect.x = positive_fmod(dst_rect.x, screen_width);
+            SDL_Texture *texture = state->ball_squashed[i] ? ball_squash_texture : ball_texture;
+            const mask_t *mask = state->ball_squashed[i] ? &ball_squash_mask : &ball_mask;
+            draw_texture(texture, mask, &dst_rect);
+            if (dst_rect.x + dst_rect.w > (int)screen_width) {
+                // With many balls, only draw the wrapped copy when it's visible
+                SDL_Rect wrap_rect = dst_rect;
+                wrap_rect.x -= screen_width;
+                draw_texture(texture, mask, &wrap_rect);
+            }
+        }
+        {
+            const body_t *player = &state->player;
+            SDL_Rect dst_rect = {.x = (int)player->px, .y = screen_height - (int)(player->py + player_height - camera_y), .w = (int)player_width, .h = (int)player_height};
+            dst_rect.x = positive_fmod(dst_rect.x, screen_width);
+            SDL_Rect wrap_rect = dst_rect;
+            wrap_rect.x -= screen_width;
+            if (state->player_grounded) {
+                draw_texture(player_texture, &player_mask, &dst_rect);
+                draw_texture(player_texture, &player_mask, &wrap_rect);
             } else {
-                if (player_jumping) {
-                    SDL_RenderCopy(renderer, player_jump_texture, NULL, &dst_rect);
-                    SDL_RenderCopy(renderer, player_jump_texture, NULL, &wrap_rect);
+                if (state->player_jumping) {
+                    draw_texture(player_jump_texture, &player_jump_mask, &dst_rect);
+                    draw_texture(player_jump_texture, &player_jump_mask, &wrap_rect);
                 } else {
-                    SDL_RenderCopy(renderer, player_fall_texture, NULL, &dst_rect);
-                    SDL_RenderCopy(renderer, player_fall_texture, NULL, &wrap_rect);
+                    draw_texture(player_fall_texture, &player_fall_mask, &dst_rect);
+                    draw_texture(player_fall_texture, &player_fall_mask, &wrap_rect);
+                }
+            }
+        }   
+        {
+            int digit = state->score;
+            int i = 0;
+            do {
+                SDL_Rect dst_rect = {screen_width - glyph_width * (i + 1), screen_height - 2.0f * glyph_height, glyph_width, glyph_height};
+                draw_texture(score_number_textures[digit % 10], &number_masks[digit % 10], &dst_rect);
+                digit /= 10;
+                i++;
+            } while (digit > 0);
+        }
+        {
+            int digit = state->high_score;
+            int i = 0;
+            do {
+                SDL_Rect dst_rect = {screen_width - glyph_width * (i + 1), screen_height - glyph_height, glyph_width, glyph_height};
+                draw_texture(highscore_number_textures[digit % 10], &number_masks[digit % 10], &dst_rect);
+                digit /= 10;
+                i++;
+            } while (digit > 0);
+        }      
+    }
+
+    if (state->game_over) {
+        SDL_Rect dst_rect = {screen_width * 0.5f - game_over_text_width * 0.5f, screen_height * 0.5f - game_over_text_height * 0.5f, game_over_text_width, game_over_text_height};
+        draw_texture(game_over_text_texture, &game_over_text_mask, &dst_rect);
+    }
+    if (view == &views[0]) {
+        end_capture_frame();
+    }
+}
+
+// Draw every game in one pass, each into its own viewport, and present.
+void render() {
+    frames++;
+    uint32_t ticks = SDL_GetTicks();
+    uint32_t delta = ticks - last_fps_update_time;
+    if (delta > 200) {
+        fps = (float)frames / (float)delta * 1000.0f;
+        last_fps_update_time = ticks;
+        frames = 0;
+    }
+
+    SDL_RenderClear(renderer);
+    for (int i = 0; i < num_games; i++) {
+        view_t *view = &views[i];
+        render_game(view, acquire_render_state(view));
+    }
+    SDL_RenderSetViewport(renderer, NULL);
+
+    if (show_fps) {
+        {
+            const int width = screen_width * grid_columns;
+            int digit = fps;
+            int i = 0;
+            do {
+                SDL_Rect dst_rect = {width - glyph_width * (i + 1), 0, glyph_width, glyph_height};
+                SDL_RenderCopy(renderer, white_on_black_number_textures[digit % 10], NULL, &dst_rect);
+                digit /= 10;
+                i++;
+            } while (digit > 0);
+            SDL_Rect dst_rect = {width - glyph_width * i - fps_text_width, 0, fps_text_width, fps_text_height};
+            SDL_RenderCopy(renderer, fps_text_texture, NULL, &dst_rect);
+        }  
+    }
+    
+    SDL_RenderPresent(renderer);
+}
+
+// Whether stepping the game would change nothing: it's over and waiting for
+// a key, or its replays have run out in a headless run.
+bool game_idle(game_t *game, uint32_t input) {
+    if (game->replaying) {
+        return false;
+    }
+    return headless || (game->game_over && input == game->last_input);
+}
+
+// Step the game once with its replayed or live input and publish the
+// result. Returns whether the game ended or restarted.
+bool step_game(game_t *game) {
+    uint32_t input = SDL_AtomicGet(&game->input_bits);
+    bool was_game_over = game->game_over;
+    switch (session_input(game, &input)) {
+    case SESSION_READY:
+        step(game, input);
+        game->last_input = input;
+        break;
+    case SESSION_WAIT:
+        return false;
+    case SESSION_OVER:
+        end_session(game);
+        break;
+    }
+    publish_render_state(game);
+    return game->game_over != was_game_over;
+}
+
+// Single-threaded frame: input, one simulation step of each game and render
+// in sequence. Used where threads aren't available (the web build).
+void one_iter() {
+    poll_input();
+    for (int i = 0; i < num_games; i++) {
+        update_session_files(&games[i]);
+    }
+    bool stepped = false;
+    for (int i = 0; i < num_games; i++) {
+        game_t *game = &games[i];
+        if (!game_idle(game, SDL_AtomicGet(&game->input_bits))) {
+            step_game(game);
+            stepped = true;
+        }
+    }
+    update_ghost_files(&games[0]);
+    if (!stepped) {
+        // Nothing can change until a key does
+        if (needs_redraw) {
+            render();
+            needs_redraw = false;
+        }
+        settle_audio(false);
+        return;
+    }
+    resume_audio();
+    render();
+    needs_redraw = true;
+}
+
+// Run the simulation of every game at a fixed rate, independently of how
+// long rendering and presenting take on the main thread.
+int simulation_thread(void *data) {
+    const uint64_t counter_frequency = SDL_GetPerformanceFrequency();
+    const uint64_t counts_per_step = (uint64_t)(seconds_per_frame * counter_frequency);
+    uint64_t next_step_time = SDL_GetPerformanceCounter();
+
+    while (!SDL_AtomicGet(&should_quit)) {
+        bool idle = true;
+        if (!SDL_AtomicGet(&sim_paused)) {
+            for (int i = 0; i < num_games && idle; i++) {
+                game_t *game = &games[i];
+                idle = game_idle(game, SDL_AtomicGet(&game->input_bits));
+            }
+        }
+        if (idle) {
+            // Stepping would change nothing, sleep until the input or the
+            // window does. Don't try to catch up on the time spent asleep.
+            SDL_SemWait(sim_wake);
+            next_step_time = SDL_GetPerformanceCounter();
+            continue;
+        }
+
+        uint64_t now = SDL_GetPerformanceCounter();
+        if (now < next_step_time) {
+            uint32_t ms = (next_step_time - now) * 1000 / counter_frequency;
+            SDL_Delay(ms > 0 ? ms : 1);
+            continue;
+        }
+
+        bool game_over_changed = false;
+        for (int i = 0; i < num_games; i++) {
+            game_t *game = &games[i];
+            if (!game_idle(game, SDL_AtomicGet(&game->input_bits))) {
+                game_over_changed |= step_game(game);
+            }
+        }
+        if (game_over_changed && sim_event != (Uint32)-1) {
+            SDL_Event e = {.type = sim_event};
+            SDL_PushEvent(&e);
+        }
+
+        next_step_time += counts_per_step;
+        if (now > next_step_time + max_catch_up_steps * counts_per_step) {
+            // Too far behind (e.g. the process was suspended), drop the backlog
+            next_step_time = now;
+        }
+    }
+
+    return 0;
+}
+
+// Render notes as signed 16-bit mono samples. Returns the number of samples
+// written, or only counts them if samples is NULL.
+int synth_render(const synth_note_t *notes, int num_notes, float pitch, int freq, int16_t *samples) {
+    int n = 0;
+    uint16_t lfsr = 0x7FFF;
+    for (int i = 0; i < num_notes; i++) {
+        const synth_note_t *note = &notes[i];
+        int length = note->length * freq / 100;
+        if (samples == NULL) {
+            n += length;
+            continue;
+        }
+        float attack = synth_attack_time * freq;
+        float phase = 0.0f;
+        for (int j = 0; j < length; j++) {
+            float t = (float)j / length;
+            float hz = pitch * (note->start_hz + (note->end_hz - note->start_hz) * t);
+            phase += hz / freq;
+            while (phase >= 1.0f) {
+                phase -= 1.0f;
+                // 15-bit LFSR noise, clocked once per period
+                uint16_t bit = (lfsr ^ (lfsr >> 1)) & 1;
+                lfsr = (lfsr >> 1) | (bit << 14);
+            }
+            bool high = note->wave == WAVE_NOISE ? lfsr & 1 : phase * 16.0f < note->duty;
+            // Ramp in and out over synth_attack_time to avoid clicks
+            float envelope = fmin(1.0f, fmin(j, length - j) / attack) * (1.0f - note->decay / 255.0f * t);
+            samples[n++] = (high ? 1.0f : -1.0f) * envelope * note->volume * 128.0f;
+        }
+    }
+    return n;
+}
+
+// Synthesize a sound effect at the rate the audio device was opened with.
+bool synthesize(sound_t *sound, const synth_note_t *notes, int num_notes, float pitch, uint8_t priority) {
+    sound->length = synth_render(notes, num_notes, pitch, audio_spec.freq, NULL);
+    sound->samples = malloc(sound->length * sizeof(int16_t));
+    if (sound->samples == NULL) {
+        return false;
+    }
+    synth_render(notes, num_notes, pitch, audio_spec.freq, sound->samples);
+    sound->priority = priority;
+    return true;
+}
+
+// Queue a sound from the simulation. Dropped if the audio callback has
+// fallen behind and the queue is full.
+void play_sound(game_t *game, sound_id_t id) {
+    if (game->muted) {
+        return;
+    }
+    int slot = spsc_reserve(&audio_commands, AUDIO_QUEUE_SIZE);
+    if (slot < 0) {
+        return;
+    }
+    audio_queue[slot] = id;
+    spsc_commit(&audio_commands);
+}
+
+// Start a sound on a free voice, or steal the oldest of the lowest priority
+// voices if they're all busy. Runs on the audio thread.
+void start_voice(const sound_t *sound) {
+    voice_t *victim = NULL;
+    for (int i = 0; i < MAX_NUM_VOICES; i++) {
+        voice_t *voice = &voices[i];
+        if (voice->sound == NULL) {
+            victim = voice;
+            break;
+        }
+        if (victim == NULL || voice->sound->priority < victim->sound->priority ||
+            (voice->sound->priority == victim->sound->priority && voice->started < victim->started)) {
+            victim = voice;
+        }
+    }
+    if (victim->sound != NULL && victim->sound->priority > sound->priority) {
+        // Everything playing matters more than this
+        return;
+    }
+    victim->sound = sound;
+    victim->position = 0;
+    victim->started = voices_started++;
+}
+
+void mix_audio(int16_t *out, int num_frames) {
+    memset(audio_mix_buffer, 0, num_frames * sizeof(int32_t));
+    for (int i = 0; i < MAX_NUM_VOICES; i++) {
+        voice_t *voice = &voices[i];
+        if (voice->sound == NULL) {
+            continue;
+        }
+        const int16_t *samples = voice->sound->samples + voice->position;
+        int n = voice->sound->length - voice->position;
+        if (n > num_frames) {
+            n = num_frames;
+        }
+        for (int f = 0; f < n; f++) {
+            audio_mix_buffer[f] += samples[f];
+        }
+        voice->position += n;
+        if (voice->position == voice->sound->length) {
+            voice->sound = NULL;
+        }
+    }
+
+    for (int f = 0; f < num_frames; f++) {
+        int32_t sample = audio_mix_buffer[f] * audio_volume / 256;
+        sample = sample < INT16_MIN ? INT16_MIN : sample > INT16_MAX ? INT16_MAX : sample;
+        for (int c = 0; c < audio_spec.channels; c++) {
+            *out++ = sample;
+        }
+    }
+}
+
+void audio_callback(void *userdata, Uint8 *stream, int len) {
+    int slot;
+    while ((slot = spsc_peek(&audio_commands, AUDIO_QUEUE_SIZE)) >= 0) {
+        start_voice(&sounds[audio_queue[slot]]);
+        spsc_release(&audio_commands);
+    }
+
+    int16_t *out = (int16_t *)stream;
+    int num_frames = len / (sizeof(int16_t) * audio_spec.channels);
+    while (num_frames > 0) {
+        int n = num_frames < MAX_AUDIO_FRAMES ? num_frames : MAX_AUDIO_FRAMES;
+        mix_audio(out, n);
+        out += n * audio_spec.channels;
+        num_frames -= n;
+    }
+
+    int busy = 0;
+    for (int i = 0; i < MAX_NUM_VOICES; i++) {
+        busy += voices[i].sound != NULL;
+    }
+    SDL_AtomicSet(&audio_busy_voices, busy);
+}
+
+// Simulate on its own thread while the main thread handles events and
+// renders. Returns false if the thread couldn't be started.
+bool run_threaded() {
+    SDL_RendererInfo renderer_info;
+    SDL_GetRendererInfo(renderer, &renderer_info);
+    bool vsync = renderer_info.flags & SDL_RENDERER_PRESENTVSYNC;
+
+    sim_event = SDL_RegisterEvents(1);
+    sim_wake = SDL_CreateSemaphore(0);
+    if (sim_wake == NULL) {
+        return false;
+    }
+
+    sim_thread = SDL_CreateThread(simulation_thread, "simulation", NULL);
+    if (sim_thread == NULL) {
+        return false;
+    }
+
+    while (!SDL_AtomicGet(&should_quit)) {
+        poll_input();
+        for (int i = 0; i < num_games; i++) {
+            update_session_files(&games[i]);
+        }
+        update_ghost_files(&games[0]);
+        bool all_over = true;
+        for (int i = 0; i < num_games && all_over; i++) {
+            all_over = acquire_render_state(&views[i])->game_over;
+        }
+
+        // An attract wall of replays keeps playing in the background
+        Uint32 window_flags = SDL_GetWindowFlags(win);
+        bool visible = !(window_flags & (SDL_WINDOW_MINIMIZED | SDL_WINDOW_HIDDEN));
+        bool paused = !visible || (!loop_replays && !(window_flags & SDL_WINDOW_INPUT_FOCUS));
+        if (SDL_AtomicSet(&sim_paused, paused) && !paused) {
+            wake_simulation();
+        }
+
+        if (paused || all_over) {
+            // Idle: draw what's there once, let the last sounds finish and
+            // then block until something happens
+            if (visible && needs_redraw) {
+                render();
+                needs_redraw = false;
+            }
+            bool audio_playing = settle_audio(paused);
+            SDL_WaitEventTimeout(NULL, audio_playing ? idle_audio_poll_time : idle_wait_timeout);
+            continue;
+        }
+
+        resume_audio();
+        render();
+        needs_redraw = true;
+        if (!vsync) {
+            SDL_Delay(16);
+        }
+    }
+
+    SDL_WaitThread(sim_thread, NULL);
+    SDL_DestroySemaphore(sim_wake);
+
+    return true;
+}
+
+// Coverage of a loaded sprite or rendered text, for capture_rect. A mask
+// that can't be made is left empty and draws nothing.
+mask_t make_mask(SDL_Surface *surface) {
+    mask_t mask = {0};
+    SDL_Surface *rgba = surface != NULL ? SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0) : NULL;
+    if (rgba == NULL) {
+        return mask;
+    }
+    mask.bits = malloc(rgba->w * rgba->h);
+    if (mask.bits != NULL) {
+        mask.w = rgba->w;
+        mask.h = rgba->h;
+        SDL_LockSurface(rgba);
+        for (int y = 0; y < rgba->h; y++) {
+            const uint8_t *pixel = (const uint8_t *)rgba->pixels + y * rgba->pitch;
+            for (int x = 0; x < rgba->w; x++) {
+                mask.bits[y * rgba->w + x] = pixel[x * 4 + 3] >= 0x80;
+            }
+        }
+        SDL_UnlockSurface(rgba);
+    }
+    SDL_FreeSurface(rgba);
+    return mask;
+}
+
+uint8_t luma(SDL_Color color) {
+    return (299 * color.r + 587 * color.g + 114 * color.b) / 1000;
+}
+
+// Raw video as YUV4MPEG2 with only the luma plane. Steps that weren't
+// captured are filled with copies of the next frame so the video keeps time.
+void write_y4m_frame(const capture_frame_t *frame) {
+    const uint8_t levels[2] = {luma(bg_color), luma(sprite_color)};
+    uint32_t repeat = num_captures_written > 0 ? frame->step - capture_last_step : 1;
+    uint8_t row[CAPTURE_WIDTH * MAX_CAPTURE_SCALE];
+    for (uint32_t i = 0; i < repeat; i++) {
+        fputs("FRAME\n", capture_file);
+        for (int y = 0; y < CAPTURE_HEIGHT; y++) {
+            for (int x = 0; x < CAPTURE_WIDTH * capture_scale; x++) {
+                row[x] = levels[frame->pixels[y * CAPTURE_WIDTH + x / capture_scale]];
+            }
+            for (int j = 0; j < capture_scale; j++) {
+                fwrite(row, 1, CAPTURE_WIDTH * capture_scale, capture_file);
+            }
+        }
+    }
+    capture_last_step = frame->step;
+    num_captures_written++;
+}
+
+void flush_gif_block() {
+    if (gif_block_size > 0) {
+        fputc(gif_block_size, capture_file);
+        fwrite(gif_block, 1, gif_block_size, capture_file);
+        gif_block_size = 0;
+    }
+}
+
+// Codes are packed least significant bit first into sub-blocks of up to 255
+// bytes.
+void write_gif_code(uint32_t code, int size) {
+    gif_bits |= code << gif_num_bits;
+    gif_num_bits += size;
+    while (gif_num_bits >= 8) {
+        gif_block[gif_block_size++] = gif_bits & 0xFF;
+        gif_bits >>= 8;
+        gif_num_bits -= 8;
+        if (gif_block_size == sizeof(gif_block)) {
+            flush_gif_block();
+        }
+    }
+}
+
+// LZW compress part of a frame, scaled up, as GIF image data. With two
+// colors the codes start at 3 bits: 0 and 1 are the pixels, then clear and
+// end of information.
+void write_gif_pixels(const uint8_t *pixels, int x0, int y0, int w, int h) {
+    const int min_code_size = 2;
+    const uint32_t clear_code = 1 << min_code_size;
+    const uint32_t end_code = clear_code + 1;
+    int code_size = min_code_size + 1;
+    uint32_t max_code = end_code;
+    memset(gif_codes, 0, sizeof(gif_codes));
+
+    fputc(min_code_size, capture_file);
+    write_gif_code(clear_code, code_size);
+    int current = -1;
+    for (int y = 0; y < h * capture_scale; y++) {
+        const uint8_t *row = &pixels[(y0 + y / capture_scale) * CAPTURE_WIDTH + x0];
+        for (int x = 0; x < w * capture_scale; x++) {
+            int pixel = row[x / capture_scale];
+            if (current < 0) {
+                current = pixel;
+                continue;
+            }
+            if (gif_codes[current][pixel] != 0) {
+                current = gif_codes[current][pixel];
+                continue;
+            }
+            write_gif_code(current, code_size);
+            gif_codes[current][pixel] = ++max_code;
+            if (max_code >= (1u << code_size)) {
+                code_size++;
+            }
+            if (max_code == GIF_MAX_CODES - 1) {
+                // Table full, start over
+                write_gif_code(clear_code, code_size);
+                memset(gif_codes, 0, sizeof(gif_codes));
+                code_size = min_code_size + 1;
+                max_code = end_code;
+            }
+            current = pixel;
+        }
+    }
+    // The decoder adds a string for the last code too, which can widen the
+    // end code
+    write_gif_code(current, code_size);
+    if (++max_code >= (1u << code_size) && code_size < 12) {
+        code_size++;
+    }
+    write_gif_code(end_code, code_size);
+    if (gif_num_bits > 0) {
+        write_gif_code(0, 8 - gif_num_bits);
+    }
+    flush_gif_block();
+    fputc(0, capture_file);
+}
+
+// Write a frame shown for delay hundredths of a second. Only the rectangle
+// that changed since the last frame is encoded, drawn over what's there.
+void write_gif_frame(const capture_frame_t *frame, uint32_t delay) {
+    int x0 = 0, y0 = 0, x1 = CAPTURE_WIDTH - 1, y1 = CAPTURE_HEIGHT - 1;
+    if (num_captures_written > 0) {
+        x0 = CAPTURE_WIDTH;
+        y0 = CAPTURE_HEIGHT;
+        x1 = y1 = -1;
+        for (int y = 0; y < CAPTURE_HEIGHT; y++) {
+            for (int x = 0; x < CAPTURE_WIDTH; x++) {
+                if (frame->pixels[y * CAPTURE_WIDTH + x] != capture_canvas[y * CAPTURE_WIDTH + x]) {
+                    x0 = SDL_min(x0, x);
+                    x1 = SDL_max(x1, x);
+                    y0 = SDL_min(y0, y);
+                    y1 = SDL_max(y1, y);
                 }
             }
-        }   
-        {
-            int digit = score;
-            int i = 0;
-            do {
-                SDL_Rect dst_rect = {screen_width - glyph_width * (i + 1), screen_height - 2.0f * glyph_height, glyph_width, glyph_height};
-                SDL_RenderCopy(renderer, score_number_textures[digit % 10], NULL, &dst_rect);
-                digit /= 10;
-                i++;
-            } while (digit > 0);
         }
-        {
-            int digit = high_score;
-            int i = 0;
-            do {
-                SDL_Rect dst_rect = {screen_width - glyph_width * (i + 1), screen_height - glyph_height, glyph_width, glyph_height};
-                SDL_RenderCopy(renderer, highscore_number_textures[digit % 10], NULL, &dst_rect);
-                digit /= 10;
-                i++;
-            } while (digit > 0);
-        }      
+        if (x1 < 0) {
+            // Back to what the last frame showed, still needs its delay
+            x0 = x1 = y0 = y1 = 0;
+        }
     }
+    memcpy(capture_canvas, frame->pixels, sizeof(capture_canvas));
 
-    if (show_fps) {
-        {
-            int digit = fps;
-            int i = 0;
-            do {
-                SDL_Rect dst_rect = {screen_width - glyph_width * (i + 1), 0, glyph_width, glyph_height};
-                SDL_RenderCopy(renderer, white_on_black_number_textures[digit % 10], NULL, &dst_rect);
-                digit /= 10;
-                i++;
-            } while (digit > 0);
-            SDL_Rect dst_rect = {screen_width - glyph_width * i - fps_text_width, 0, fps_text_width, fps_text_height};
-            SDL_RenderCopy(renderer, fps_text_texture, NULL, &dst_rect);
-        }  
+    int x = x0 * capture_scale, y = y0 * capture_scale;
+    int w = (x1 - x0 + 1) * capture_scale, h = (y1 - y0 + 1) * capture_scale;
+    const uint8_t header[] = {
+        0x21, 0xF9, 4, 1 << 2, delay & 0xFF, delay >> 8, 0, 0, // leave in place, delay
+        0x2C, x & 0xFF, x >> 8, y & 0xFF, y >> 8, w & 0xFF, w >> 8, h & 0xFF, h >> 8, 0,
+    };
+    fwrite(header, 1, sizeof(header), capture_file);
+    write_gif_pixels(frame->pixels, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+    num_captures_written++;
+}
+
+// Time of a step in the hundredths of a second GIF delays are counted in
+uint32_t gif_time(uint32_t step) {
+    return (uint64_t)step * 100 / 60;
+}
+
+// A frame is written once the next one arrives and its delay is known.
+// Repeats only extend it, and since most viewers don't show frames faster
+// than every 2/100 s, frames closer than that are merged into it.
+void add_gif_frame(const capture_frame_t *frame) {
+    if (has_pending_capture) {
+        if (memcmp(frame->pixels, pending_capture.pixels, sizeof(frame->pixels)) == 0) {
+            return;
+        }
+        uint32_t delay = gif_time(frame->step) - gif_time(pending_capture.step);
+        if (delay < 2) {
+            memcpy(pending_capture.pixels, frame->pixels, sizeof(frame->pixels));
+            return;
+        }
+        write_gif_frame(&pending_capture, delay);
     }
+    pending_capture = *frame;
+    has_pending_capture = true;
+}
 
-    if (game_over) {
-        SDL_Rect dst_rect = {screen_width * 0.5f - game_over_text_width * 0.5f, screen_height * 0.5f - game_over_text_height * 0.5f, game_over_text_width, game_over_text_height};
-        SDL_RenderCopy(renderer, game_over_text_texture, NULL, &dst_rect);
+int capture_thread(void *data) {
+    for (;;) {
+        SDL_SemWait(capture_ready);
+        int slot = spsc_peek(&captures, CAPTURE_QUEUE_SIZE);
+        if (slot < 0) {
+            if (SDL_AtomicGet(&capture_stopping)) {
+                break;
+            }
+            continue;
+        }
+        if (capture_gif) {
+            add_gif_frame(&capture_queue[slot]);
+        } else {
+            write_y4m_frame(&capture_queue[slot]);
+        }
+        spsc_release(&captures);
     }
-    
-    SDL_RenderPresent(renderer);
+
+    if (capture_gif) {
+        if (has_pending_capture) {
+            // Hold the last frame for a second before looping
+            write_gif_frame(&pending_capture, 100);
+        }
+        fputc(0x3B, capture_file);
+    }
+    return 0;
 }
 
-#ifdef WIN32
-int WinMain() {
+// Start capturing to path, as an animated GIF if it ends in .gif and as
+// YUV4MPEG2 raw video otherwise.
+bool start_capture(const char *path) {
+    capture_file = fopen(path, "wb");
+    if (capture_file == NULL) {
+        return false;
+    }
+    size_t length = strlen(path);
+    capture_gif = length >= 4 && strcmp(path + length - 4, ".gif") == 0;
+    int width = CAPTURE_WIDTH * capture_scale;
+    int height = CAPTURE_HEIGHT * capture_scale;
+    if (capture_gif) {
+        const uint8_t header[] = {
+            'G', 'I', 'F', '8', '9', 'a', width & 0xFF, width >> 8, height & 0xFF, height >> 8,
+            0x80, 0, 0, // two color global palette
+            bg_color.r, bg_color.g, bg_color.b,
+            sprite_color.r, sprite_color.g, sprite_color.b,
+            0x21, 0xFF, 11, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 3, 1, 0, 0, 0, // loop forever
+        };
+        fwrite(header, 1, sizeof(header), capture_file);
+    } else {
+        fprintf(capture_file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 Cmono\n", width, height);
+    }
+
+    capture_ready = SDL_CreateSemaphore(0);
+    if (capture_ready == NULL) {
+        return false;
+    }
+    capture_worker = SDL_CreateThread(capture_thread, "capture", NULL);
+    return capture_worker != NULL;
+}
+
+// Encode whatever is still queued and close the capture.
+void stop_capture() {
+    if (capture_worker == NULL) {
+        return;
+    }
+    SDL_AtomicSet(&capture_stopping, 1);
+    SDL_SemPost(capture_ready);
+    SDL_WaitThread(capture_worker, NULL);
+    capture_worker = NULL;
+    SDL_DestroySemaphore(capture_ready);
+    if (fclose(capture_file) != 0) {
+        fprintf(stderr, "Can't write capture\n");
+    }
+    if (captures_dropped > 0) {
+        printf("Capture dropped %u frames\n", captures_dropped);
+    }
+}
+
+// Map a level pack and check that it's safe to use in place.
+bool load_level_pack(const char *path) {
+    uint8_t *data = NULL;
+    size_t size = 0;
+#ifdef __linux__
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+        void *mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED) {
+            data = mapping;
+            size = file_stat.st_size;
+        }
+    }
+    close(fd);
 #else
-int main() {
+    // No mmap, read it all in instead
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    if (fseek(file, 0, SEEK_END) == 0 && ftell(file) > 0) {
+        size = ftell(file);
+        data = malloc(size);
+        rewind(file);
+        if (data != NULL && fread(data, 1, size, file) != size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
 #endif
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
-        return EXIT_FAILURE;
+    if (data == NULL) {
+        return false;
+    }
+    level_pack = data;
+    level_pack_size = size;
+
+    const level_pack_header_t *header = (const level_pack_header_t *)data;
+    bool valid = size >= sizeof(level_pack_header_t) &&
+                 memcmp(header->magic, LEVEL_PACK_MAGIC, 4) == 0 &&
+                 header->version == LEVEL_PACK_VERSION &&
+                 header->scale == scale &&
+                 header->file_size == size &&
+                 header->stages_offset % LEVEL_PACK_ALIGNMENT == 0 &&
+                 header->brick_x_offset % LEVEL_PACK_ALIGNMENT == 0 &&
+                 header->brick_y_offset % LEVEL_PACK_ALIGNMENT == 0 &&
+                 header->stages_offset + (uint64_t)header->num_stages * sizeof(level_pack_stage_t) <= size &&
+                 header->brick_x_offset + (uint64_t)header->num_bricks * sizeof(float) <= size &&
+                 header->brick_y_offset + (uint64_t)header->num_bricks * sizeof(float) <= size &&
+                 header->brick_type_offset + (uint64_t)header->num_bricks <= size;
+    for (uint32_t i = 0; valid && i < header->num_stages; i++) {
+        const level_pack_stage_t *stage = (const level_pack_stage_t *)(data + header->stages_offset) + i;
+        valid = stage->num_bricks <= MAX_NUM_BRICKS && (uint64_t)stage->first_brick + stage->num_bricks <= header->num_bricks;
     }
+    if (!valid) {
+        unload_level_pack();
+    }
+    return valid;
+}
 
-    int image_flags = IMG_INIT_PNG;
+void unload_level_pack() {
+    if (level_pack == NULL) {
+        return;
+    }
+#ifdef __linux__
+    munmap((void *)level_pack, level_pack_size);
+#else
+    free((void *)level_pack);
+#endif
+    level_pack = NULL;
+    level_stage = NULL;
+}
 
-    if (IMG_Init(image_flags) != image_flags)
-    {
-        printf("Err: %s\n", IMG_GetError());
+uint32_t fnv1a(uint32_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
     }
+    return hash;
+}
 
-    if (TTF_Init()) {
-        return EXIT_FAILURE;
+// Identify a stage by where it starts and its bricks, so the same layout
+// keeps its ghost whichever pack or index it's loaded from.
+uint32_t hash_stage(const level_pack_stage_t *stage) {
+    const level_pack_header_t *header = (const level_pack_header_t *)level_pack;
+    uint32_t hash = 2166136261u;
+    hash = fnv1a(hash, &stage->start_x, sizeof(stage->start_x));
+    hash = fnv1a(hash, &stage->start_y, sizeof(stage->start_y));
+    hash = fnv1a(hash, (const float *)(level_pack + header->brick_x_offset) + stage->first_brick, stage->num_bricks * sizeof(float));
+    hash = fnv1a(hash, (const float *)(level_pack + header->brick_y_offset) + stage->first_brick, stage->num_bricks * sizeof(float));
+    return fnv1a(hash, level_pack + header->brick_type_offset + stage->first_brick, stage->num_bricks);
+}
+
+#ifndef __EMSCRIPTEN__
+// Start every game over from its first replay, as if just launched.
+bool restart_games() {
+    // Keep the assets loaded in between
+    acquire_assets();
+    bool created = true;
+    for (int i = 0; i < num_games && created; i++) {
+        destroy_game(i);
+        memset(&games[i], 0, sizeof(game_t));
+        memset(&views[i], 0, sizeof(view_t));
+        created = create_game(i);
     }
+    release_assets();
+    num_games_playing = num_games;
+    SDL_AtomicSet(&should_quit, 0);
+    return created;
+}
 
-    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048)) {
-        return EXIT_FAILURE;
+// Replay the queued sessions through one_iter as fast as possible, timing
+// every frame. Each pass starts the games over, so they all do the same work.
+void run_headless(int passes) {
+    const uint64_t counter_frequency = SDL_GetPerformanceFrequency();
+    for (num_perf_passes = 0; num_perf_passes < passes && num_frame_times < MAX_PERF_FRAMES; num_perf_passes++) {
+        if (num_perf_passes > 0 && !restart_games()) {
+            break;
+        }
+        perf_pass_start[num_perf_passes] = num_frame_times;
+        uint64_t start_time = SDL_GetPerformanceCounter();
+        uint32_t start_steps = num_steps;
+        while (!SDL_AtomicGet(&should_quit)) {
+            uint64_t frame_start_time = SDL_GetPerformanceCounter();
+            one_iter();
+            if (num_frame_times < MAX_PERF_FRAMES) {
+                frame_times[num_frame_times++] = (double)(SDL_GetPerformanceCounter() - frame_start_time) * 1e6 / counter_frequency;
+            }
+        }
+        perf_pass_seconds[num_perf_passes] = (double)(SDL_GetPerformanceCounter() - start_time) / counter_frequency;
+        perf_pass_steps[num_perf_passes] = num_steps - start_steps;
     }
+    perf_pass_start[num_perf_passes] = num_frame_times;
+}
 
-    Mix_Volume(-1, MIX_MAX_VOLUME / 4);
+int compare_floats(const void *a, const void *b) {
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
 
-    win = SDL_CreateWindow(window_title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screen_width, screen_height, 0);
-    if (win == NULL) {
+// Sorts the values.
+float median(float *values, int count) {
+    qsort(values, count, sizeof(float), compare_floats);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) * 0.5f;
+}
+
+// Print the headless run's measurements, optionally saving them as a new
+// baseline or checking them against one. Returns the exit status.
+int report_perf(const char *baseline_path, const char *save_path, double threshold) {
+    // Single frames are noisy, so each timing is the median over the passes
+    float p50[MAX_PERF_PASSES], p95[MAX_PERF_PASSES], p99[MAX_PERF_PASSES], steps_per_second[MAX_PERF_PASSES];
+    int num_passes = 0;
+    for (int pass = 0; pass < num_perf_passes; pass++) {
+        float *times = frame_times + perf_pass_start[pass];
+        int num_times = perf_pass_start[pass + 1] - perf_pass_start[pass];
+        if (num_times == 0) {
+            continue;
+        }
+        qsort(times, num_times, sizeof(float), compare_floats);
+        p50[num_passes] = times[(int)(0.50 * (num_times - 1))];
+        p95[num_passes] = times[(int)(0.95 * (num_times - 1))];
+        p99[num_passes] = times[(int)(0.99 * (num_times - 1))];
+        steps_per_second[num_passes] = perf_pass_steps[pass] / perf_pass_seconds[pass];
+        num_passes++;
+    }
+    if (num_passes == 0) {
+        fprintf(stderr, "Nothing was replayed\n");
         return EXIT_FAILURE;
     }
+    long peak_rss = 0;
+#ifdef __linux__
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        peak_rss = usage.ru_maxrss;
+    }
+#endif
 
-    SDL_Surface *icon = IMG_Load("res/icon.png");
-    SDL_SetWindowIcon(win, icon);
-    SDL_FreeSurface(icon);
+    struct {
+        const char *name;
+        double value;
+        bool higher_is_worse;
+        bool in_baseline;
+        double baseline;
+    } metrics[] = {
+        {"frame_p50_us", median(p50, num_passes), true},
+        {"frame_p95_us", median(p95, num_passes), true},
+        {"frame_p99_us", median(p99, num_passes), true},
+        {"steps_per_second", median(steps_per_second, num_passes), false},
+        {"peak_rss_kb", peak_rss, true},
+    };
+    const int num_metrics = SDL_arraysize(metrics);
 
-    renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-    if (renderer == NULL) {
-        return EXIT_FAILURE;
+    if (save_path != NULL) {
+        FILE *file = fopen(save_path, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Can't write %s\n", save_path);
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < num_metrics; i++) {
+            fprintf(file, "%s %.1f\n", metrics[i].name, metrics[i].value);
+        }
+        fclose(file);
     }
 
-    SDL_SetRenderDrawColor(renderer, bg_color.r, bg_color.g, bg_color.b, bg_color.a);
+    if (baseline_path != NULL) {
+        FILE *file = fopen(baseline_path, "r");
+        if (file == NULL) {
+            fprintf(stderr, "Can't read baseline %s\n", baseline_path);
+            return EXIT_FAILURE;
+        }
+        char name[64];
+        double value;
+        while (fscanf(file, "%63s %lf", name, &value) == 2) {
+            for (int i = 0; i < num_metrics; i++) {
+                if (strcmp(name, metrics[i].name) == 0) {
+                    metrics[i].in_baseline = true;
+                    metrics[i].baseline = value;
+                }
+            }
+        }
+        fclose(file);
+    }
+
+    bool regressed = false;
+    printf("%-18s %12s %12s %8s\n", "metric", "current", "baseline", "change");
+    for (int i = 0; i < num_metrics; i++) {
+        printf("%-18s %12.1f", metrics[i].name, metrics[i].value);
+        if (baseline_path != NULL && !metrics[i].in_baseline) {
+            // An old or truncated baseline mustn't pass by checking nothing
+            printf(" %12s %8s  MISSING\n", "-", "-");
+            regressed = true;
+            continue;
+        }
+        if (metrics[i].baseline <= 0.0) {
+            // Not measured on this platform
+            printf("\n");
+            continue;
+        }
+        double change = metrics[i].value / metrics[i].baseline - 1.0;
+        bool worse = metrics[i].higher_is_worse ? change > threshold : change < -threshold;
+        printf(" %12.1f %+7.1f%%%s\n", metrics[i].baseline, change * 100.0, worse ? "  REGRESSION" : "");
+        regressed |= worse;
+    }
+    int last = num_perf_passes - 1;
+    printf("%d passes of %d frames, %u steps in %.2f s\n", num_passes, perf_pass_start[last + 1] - perf_pass_start[last],
+           perf_pass_steps[last], perf_pass_seconds[last]);
+
+    return regressed || replay_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
 
-    SDL_RenderSetLogicalSize(renderer, screen_width, screen_height);
+// Load the shared assets for the first game that needs them.
+void acquire_assets() {
+    if (asset_refs++ > 0) {
+        return;
+    }
 
     loading_surf = IMG_Load("res/ball.png");
     printf("%s\n", IMG_GetError());
     assert(loading_surf != NULL);
     ball_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
     assert(ball_texture != NULL);
+    ball_mask = make_mask(loading_surf);
     loading_surf = IMG_Load("res/ball_squash.png");
     ball_squash_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
+    ball_squash_mask = make_mask(loading_surf);
 
     loading_surf = IMG_Load("res/player.png");
     player_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
+    player_mask = make_mask(loading_surf);
     loading_surf = IMG_Load("res/player_jumping.png");
     player_jump_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
+    player_jump_mask = make_mask(loading_surf);
     loading_surf = IMG_Load("res/player_fall.png");
     player_fall_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
+    player_fall_mask = make_mask(loading_surf);
 
     loading_surf = IMG_Load("res/brick.png");
     brick_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
     assert(brick_texture != NULL);
+    brick_mask = make_mask(loading_surf);
 
-    TTF_Font *font = TTF_OpenFont("res/EffortsPro.ttf", 16.0f * scale);
+    font = TTF_OpenFont("res/EffortsPro.ttf", 16.0f * scale);
     assert(font != NULL);
 
     TTF_SizeText(font, "a", &glyph_width, &glyph_height);
     SDL_Color white = {255, 255, 255, 255};
-    SDL_Color black = {0, 0, 0, 255};    
-    SDL_Color text_color = { 0x43, 0x52, 0x3D, 0xFF };    
+    SDL_Color black = {0, 0, 0, 255};
+    SDL_Color text_color = { 0x43, 0x52, 0x3D, 0xFF };
     for (int i = 0; i < 10; i++) {
         loading_surf = TTF_RenderGlyph_Shaded(font, '0' + i, white, black);
         white_on_black_number_textures[i] = SDL_CreateTextureFromSurface(renderer, loading_surf);
@@ -763,56 +3228,331 @@ int main() {
         score_number_textures[i] = SDL_CreateTextureFromSurface(renderer, loading_surf);
         loading_surf = TTF_RenderGlyph_Blended(font, '0' + i, text_color);
         highscore_number_textures[i] = SDL_CreateTextureFromSurface(renderer, loading_surf);
+        number_masks[i] = make_mask(loading_surf);
     }
 
     TTF_SizeText(font, game_over_text, &game_over_text_width, &game_over_text_height);
     loading_surf = TTF_RenderText_Shaded(font, game_over_text, text_color, bg_color);
     game_over_text_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
+    loading_surf = TTF_RenderText_Blended(font, game_over_text, text_color);
+    game_over_text_mask = make_mask(loading_surf);
 
     TTF_SizeText(font, fps_text, &fps_text_width, &fps_text_height);
     loading_surf = TTF_RenderText_Shaded(font, fps_text, white, black);
     fps_text_texture = SDL_CreateTextureFromSurface(renderer, loading_surf);
 
-    sfx_jump = Mix_LoadWAV("res/jump.wav");
-    assert(sfx_jump != NULL);
-    sfx_game_over = Mix_LoadWAV("res/game_over.wav");
-    assert(sfx_game_over != NULL);
-    sfx_bounce_start = Mix_LoadWAV("res/bounce_start.wav");
-    assert(sfx_bounce_start != NULL);
-    sfx_bounce_end = Mix_LoadWAV("res/bounce_end.wav");
-    assert(sfx_bounce_end != NULL);
-    sfx_brick_break = Mix_LoadWAV("res/hit.wav");
-    assert(sfx_brick_break != NULL);
+    bool synthesized = synthesize(&sounds[SOUND_JUMP], jump_notes, SDL_arraysize(jump_notes), 1.0f, 2);
+    assert(synthesized);
+    synthesized = synthesize(&sounds[SOUND_GAME_OVER], game_over_notes, SDL_arraysize(game_over_notes), 1.0f, 3);
+    assert(synthesized);
+    synthesized = synthesize(&sounds[SOUND_BOUNCE_START], bounce_start_notes, SDL_arraysize(bounce_start_notes), 1.0f, 1);
+    assert(synthesized);
+    synthesized = synthesize(&sounds[SOUND_BOUNCE_END], bounce_end_notes, SDL_arraysize(bounce_end_notes), 1.0f, 1);
+    assert(synthesized);
+    for (int i = 0; i < NUM_BRICK_BREAK_PITCHES; i++) {
+        synthesized = synthesize(&sounds[SOUND_BRICK_BREAK + i], brick_break_notes, SDL_arraysize(brick_break_notes), powf(2.0f, brick_break_semitones[i] / 12.0f), 2);
+        assert(synthesized);
+    }
+}
+
+// Free the shared assets once the last game is done with them.
+void release_assets() {
+    if (--asset_refs > 0) {
+        return;
+    }
+    SDL_Texture *textures[] = {
+        ball_texture, ball_squash_texture, player_texture, player_jump_texture, player_fall_texture, brick_texture,
+        game_over_text_texture, fps_text_texture,
+    };
+    for (int i = 0; i < (int)SDL_arraysize(textures); i++) {
+        SDL_DestroyTexture(textures[i]);
+    }
+    mask_t *masks[] = {
+        &ball_mask, &ball_squash_mask, &player_mask, &player_jump_mask, &player_fall_mask, &brick_mask,
+        &game_over_text_mask,
+    };
+    for (int i = 0; i < (int)SDL_arraysize(masks); i++) {
+        free(masks[i]->bits);
+    }
+    for (int i = 0; i < 10; i++) {
+        SDL_DestroyTexture(white_on_black_number_textures[i]);
+        SDL_DestroyTexture(score_number_textures[i]);
+        SDL_DestroyTexture(highscore_number_textures[i]);
+        free(number_masks[i].bits);
+    }
+    for (int i = 0; i < NUM_SOUNDS; i++) {
+        free(sounds[i].samples);
+    }
+    TTF_CloseFont(font);
+}
+
+// Set up game i in its cell of the grid and start its first run.
+bool create_game(int i) {
+    acquire_assets();
+
+    game_t *game = &games[i];
+    game->render_state_write = 0;
+    SDL_AtomicSet(&game->render_state_shared, 2);
+    game->next_replay = num_replays > 0 ? i % num_replays : 0;
+    // Only the first game of an attract grid is heard
+    game->muted = i > 0 && num_replays > 0;
+    game->has_ghost = i == 0 && pref_path != NULL;
+
+    view_t *v = &views[i];
+    v->game = game;
+    v->viewport = (SDL_Rect){(i % grid_columns) * screen_width, (i / grid_columns) * screen_height, screen_width, screen_height};
+    v->render_state_read = 1;
+    v->particle_rng = 0x2545F491 + i;
+
+    if (num_replays > 0) {
+        game->reading_replays = true;
+        game->replaying = true;
+        update_session_files(game);
+        if (!start_next_session(game)) {
+            return false;
+        }
+    }
+    init(game);
+    publish_render_state(game);
+    return true;
+}
+
+void destroy_game(int i) {
+    game_t *game = &games[i];
+    // Write out the rest of the recording
+    game->reading_replays = false;
+    update_session_files(game);
+    if (game->recording_dropped) {
+        fprintf(stderr, "Recording fell behind and was cut short\n");
+    }
+    if (game->session_in != NULL) {
+        fclose(game->session_in);
+        game->session_in = NULL;
+    }
+    if (game->session_out != NULL) {
+        fclose(game->session_out);
+        game->session_out = NULL;
+    }
+    release_assets();
+}
+
+#ifdef WIN32
+int WinMain() {
+    int argc = __argc;
+    char **argv = __argv;
+#else
+int main(int argc, char *argv[]) {
+#endif
+    const char *record_path = NULL;
+    const char *level_pack_path = NULL;
+    int stage = 0;
+    const char *perf_baseline_path = NULL;
+    const char *perf_save_path = NULL;
+    double perf_threshold = 0.15;
+    int perf_passes = 1;
+    const char *capture_path = NULL;
+    bool usage = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--audio-frames") == 0 && i + 1 < argc) {
+            audio_buffer_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc && num_replays < MAX_NUM_REPLAYS) {
+            replay_paths[num_replays++] = argv[++i];
+        } else if (strcmp(argv[i], "--level-pack") == 0 && i + 1 < argc) {
+            level_pack_path = argv[++i];
+        } else if (strcmp(argv[i], "--stage") == 0 && i + 1 < argc) {
+            stage = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--perf-baseline") == 0 && i + 1 < argc) {
+            perf_baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--perf-save") == 0 && i + 1 < argc) {
+            perf_save_path = argv[++i];
+        } else if (strcmp(argv[i], "--perf-threshold") == 0 && i + 1 < argc) {
+            perf_threshold = atof(argv[++i]) / 100.0;
+        } else if (strcmp(argv[i], "--perf-repeat") == 0 && i + 1 < argc) {
+            perf_passes = atoi(argv[++i]);
+            perf_passes = SDL_clamp(perf_passes, 1, MAX_PERF_PASSES);
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else if (strcmp(argv[i], "--capture-scale") == 0 && i + 1 < argc) {
+            capture_scale = atoi(argv[++i]);
+            capture_scale = SDL_clamp(capture_scale, 1, MAX_CAPTURE_SCALE);
+        } else if (strcmp(argv[i], "--games") == 0 && i + 1 < argc) {
+            num_games = atoi(argv[++i]);
+            num_games = SDL_clamp(num_games, 1, MAX_NUM_GAMES);
+        } else {
+            usage = true;
+        }
+    }
+    // There are only keys for two players, so more games than that need
+    // replays to show
+    if (usage || (headless && num_replays == 0) || (num_games > NUM_KEYBOARD_PLAYERS && num_replays == 0)) {
+        fprintf(stderr, "usage: %s [--audio-frames N] [--level-pack FILE [--stage N]] [--record FILE] [--replay FILE]...\n"
+                        "       [--games N] [--capture FILE [--capture-scale N]]\n"
+                        "       [--headless [--perf-baseline FILE] [--perf-save FILE] [--perf-threshold PERCENT] [--perf-repeat N]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    games = calloc(num_games, sizeof(game_t));
+    views = calloc(num_games, sizeof(view_t));
+    if (games == NULL || views == NULL) {
+        return EXIT_FAILURE;
+    }
+    if (level_pack_path != NULL) {
+        if (!load_level_pack(level_pack_path)) {
+            fprintf(stderr, "Can't load level pack %s\n", level_pack_path);
+            return EXIT_FAILURE;
+        }
+        const level_pack_header_t *header = (const level_pack_header_t *)level_pack;
+        if (stage < 0 || (uint32_t)stage >= header->num_stages) {
+            fprintf(stderr, "%s has no stage %d\n", level_pack_path, stage);
+            return EXIT_FAILURE;
+        }
+        level_stage = (const level_pack_stage_t *)(level_pack + header->stages_offset) + stage;
+        level_stage_hash = hash_stage(level_stage);
+    }
+
+    if (headless) {
+        // No display or sound card needed
+        SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+        SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
+        return EXIT_FAILURE;
+    }
+
+    int image_flags = IMG_INIT_PNG;
+
+    if (IMG_Init(image_flags) != image_flags)
+    {
+        printf("Err: %s\n", IMG_GetError());
+    }
+
+    if (TTF_Init()) {
+        return EXIT_FAILURE;
+    }
+
+    // SDL wants a power of two
+    int audio_frames = MIN_AUDIO_FRAMES;
+    while (audio_frames < audio_buffer_frames && audio_frames < MAX_AUDIO_FRAMES) {
+        audio_frames *= 2;
+    }
+    SDL_AudioSpec desired = {
+        .freq = audio_frequency,
+        .format = AUDIO_S16SYS,
+        .channels = 2,
+        .samples = audio_frames,
+        .callback = audio_callback,
+    };
+    audio_device = SDL_OpenAudioDevice(NULL, 0, &desired, &audio_spec, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (audio_device == 0) {
+        return EXIT_FAILURE;
+    }
+
+    // Two games sit side by side, more fill a square-ish grid. Big grids get
+    // a smaller window, the renderer scales them down.
+    if (num_games == 2) {
+        grid_columns = 2;
+    } else {
+        while (grid_columns * grid_columns < num_games) {
+            grid_columns++;
+        }
+    }
+    grid_rows = (num_games + grid_columns - 1) / grid_columns;
+    int window_shrink = (SDL_max(grid_columns, grid_rows) + 1) / 2;
+    int grid_width = grid_columns * screen_width;
+    int grid_height = grid_rows * screen_height;
+
+    win = SDL_CreateWindow(window_title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, grid_width / window_shrink, grid_height / window_shrink, 0);
+    if (win == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    SDL_Surface *icon = IMG_Load("res/icon.png");
+    SDL_SetWindowIcon(win, icon);
+    SDL_FreeSurface(icon);
+
+    renderer = SDL_CreateRenderer(win, -1, headless ? SDL_RENDERER_SOFTWARE : SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (renderer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    SDL_SetRenderDrawColor(renderer, bg_color.r, bg_color.g, bg_color.b, bg_color.a);
+
+    SDL_RenderSetLogicalSize(renderer, grid_width, grid_height);
 
-    init();
+    if (num_replays == 0 && num_games == 1) {
+        // Replays don't get to replace the best run, and there's only one
+        // ghost to race
+        pref_path = SDL_GetPrefPath("segfault0x61", "Uphill Break");
+    }
+    // An attract grid keeps cycling through the replays
+    loop_replays = !headless && num_games > 1 && num_replays > 0;
+    num_games_playing = num_games;
+    if (record_path != NULL) {
+        // Only the first game is recorded
+        start_recording(&games[0], record_path);
+    }
+
+    if (capture_path != NULL && !start_capture(capture_path)) {
+        fprintf(stderr, "Can't capture to %s\n", capture_path);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < num_games; i++) {
+        if (!create_game(i)) {
+            return EXIT_FAILURE;
+        }
+    }
+    SDL_PauseAudioDevice(audio_device, 0);
 
+    int status = EXIT_SUCCESS;
 #ifdef __EMSCRIPTEN__
     emscripten_set_main_loop(one_iter, 60, 1);
 #else
-    while (!should_quit) {
-        one_iter();
-        SDL_Delay(16);
+    if (headless) {
+        run_headless(perf_passes);
+        status = report_perf(perf_baseline_path, perf_save_path, perf_threshold);
+    } else if (!run_threaded()) {
+        return EXIT_FAILURE;
     }
 #endif
 
-    Mix_FreeChunk(sfx_jump);
-    Mix_FreeChunk(sfx_game_over);
-    Mix_FreeChunk(sfx_bounce_start);
-    Mix_FreeChunk(sfx_bounce_end);
-    Mix_FreeChunk(sfx_brick_break);
-    Mix_CloseAudio();
-    Mix_Quit();
+    stop_capture();
+    // A run that ended just before quitting still gets saved
+    update_ghost_files(&games[0]);
+    unload_level_pack();
 
-    IMG_Quit();
+    if (ghost_in != NULL) {
+        fclose(ghost_in);
+    }
+    if (ghost_out != NULL) {
+        // Unfinished run
+        fclose(ghost_out);
+        char temp_path[1024];
+        snprintf(temp_path, sizeof(temp_path), "%s%s", pref_path, ghost_temp_file_name);
+        remove(temp_path);
+    }
+    SDL_free(pref_path);
 
-    TTF_CloseFont(font);
+    SDL_CloseAudioDevice(audio_device);
+    for (int i = 0; i < num_games; i++) {
+        destroy_game(i);
+    }
+    free(games);
+    free(views);
+
+    IMG_Quit();
     TTF_Quit();
 
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(win);
     SDL_Quit();
 
-    return EXIT_SUCCESS;
+    return status;
 }
 
 bool check_collision_rect_rect(float ax, float ay, float aw, float ah, float bx, float by, float bw, float bh) {
@@ -899,11 +3639,22 @@ float pivot(float velocity) {
     return fmax(0.0f, velocity - player_max_velocity / time_to_pivot);
 }
 
-float rand_range(float min, float max) {
-    float r = (float)rand() / (float)RAND_MAX;
+// xorshift32. The state must not be zero.
+float xorshift_range(uint32_t *state, float min, float max) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    float r = (float)(*state >> 8) / (float)(1 << 24);
     return min + r * (max - min);
 }
 
+// Random number for the game being stepped. Each game has its own generator
+// so games running side by side don't change each other's levels, and
+// replays of them stay exact.
+float rand_range(game_t *game, float min, float max) {
+    return xorshift_range(&game->rng, min, max);
+}
+
 float positive_fmod(float x, float mod) {
     float xm = fmod(x, mod);
     if (xm < 0) {
@@ -911,3 +3662,44 @@ float positive_fmod(float x, float mod) {
     }
     return xm;
 }
+
+// Shortest signed horizontal distance on the wrapped play field
+float wrapped_delta(float dx) {
+    return positive_fmod(dx + screen_width * 0.5f, screen_width) - screen_width * 0.5f;
+}
+
+// Return the slot to write the next element into, or -1 if the queue is full.
+int spsc_reserve(spsc_queue_t *queue, int size) {
+    uint32_t head = SDL_AtomicGet(&queue->head);
+    uint32_t tail = SDL_AtomicGet(&queue->tail);
+    if (head - tail >= (uint32_t)size) {
+        return -1;
+    }
+    return head & (size - 1);
+}
+
+// Publish the element written into the reserved slot.
+void spsc_commit(spsc_queue_t *queue) {
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicAdd(&queue->head, 1);
+}
+
+// Return the slot of the oldest element, or -1 if the queue is empty.
+int spsc_peek(spsc_queue_t *queue, int size) {
+    uint32_t tail = SDL_AtomicGet(&queue->tail);
+    if ((uint32_t)SDL_AtomicGet(&queue->head) == tail) {
+        return -1;
+    }
+    SDL_MemoryBarrierAcquire();
+    return tail & (size - 1);
+}
+
+// Hand the peeked slot back to the producer.
+void spsc_release(spsc_queue_t *queue) {
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicAdd(&queue->tail, 1);
+}
+
+bool spsc_empty(spsc_queue_t *queue) {
+    return SDL_AtomicGet(&queue->head) == SDL_AtomicGet(&queue->tail);
+}